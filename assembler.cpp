@@ -0,0 +1,111 @@
+#include "assembler.h"
+#include <fmt/format.h>
+#include <cassert>
+
+Label Assembler::new_label() {
+  label_addr.push_back(-1);
+  pending.emplace_back();
+  return label_count() - 1;
+}
+
+void Assembler::bind(Label l) {
+  l -= label_base;
+  assert(label_addr[l] < 0);
+  label_addr[l] = size();
+  for (int at: pending[l]) code[at - base].arg = size();
+  pending[l].clear();
+}
+
+int Assembler::emit(Op op, int arg) {
+  code.push_back({op, arg});
+  origin_of.push_back(origin);
+  return size() - 1;
+}
+
+void Assembler::jump(Op op, Label l) {
+  l -= label_base;
+  int at = emit(op, label_addr[l]);
+  if (label_addr[l] < 0) pending[l].push_back(at);
+}
+
+void Assembler::append(const Assembler& part, std::span<const Label> externals) {
+  assert(part.base == 0 && part.label_base == 0);
+  int offset = size();
+  for (auto insn: part.code) {
+    if ((insn.op == Op::fjp || insn.op == Op::ujp) && insn.arg >= 0) insn.arg += offset;
+    code.push_back(insn);
+  }
+  origin_of.insert(origin_of.end(), part.origin_of.begin(), part.origin_of.end());
+  for (auto [node, addr]: part.marks) marks.push_back({node, addr + offset});
+  for (int l = 0; l < static_cast<int>(externals.size()); ++l) {
+    int target = externals[l] - label_base;
+    for (int at: part.pending[l]) {
+      code[at + offset - base].arg = label_addr[target];
+      if (label_addr[target] < 0) pending[target].push_back(at + offset);
+    }
+  }
+  for (int l = static_cast<int>(externals.size()); l < static_cast<int>(part.label_addr.size()); ++l) {
+    assert(part.label_addr[l] >= 0);
+    label_addr.push_back(part.label_addr[l] + offset);
+    pending.emplace_back();
+  }
+}
+
+std::string Assembler::render() const {
+  std::string out;
+  render(out);
+  return out;
+}
+
+void Assembler::render(std::string& out) const {
+  static const char* names[] = {
+    "ssp", "ldc i", "ldc c", "lod i 0", "str i 0",
+    "add i", "sub i", "mul i", "div i", "mod",
+    "grt i", "les i", "geq i", "leq i", "equ i", "neq i",
+    "and", "or", "xor", "not",
+    "dpl i", "pop", "fjp", "ujp",
+    "in i", "out i", "out c", "hlt",
+  };
+  // A jump target is named after the first label bound to its address.
+  int n = static_cast<int>(code.size());
+  std::vector<int> name_at(n + 1, -1);
+  for (int l = static_cast<int>(label_addr.size()) - 1; l >= 0; --l) {
+    assert(label_addr[l] >= 0);
+    name_at[label_addr[l] - base] = label_base + l;
+  }
+  std::vector<bool> targeted(n + 1);
+  for (auto& insn: code) if (insn.op == Op::fjp || insn.op == Op::ujp) targeted[insn.arg - base] = true;
+
+  auto it = std::back_inserter(out);
+  for (int i = 0; i <= n; ++i) {
+    if (targeted[i]) fmt::format_to(it, "L{}:\n", name_at[i]);
+    if (i == n) break;
+    auto& insn = code[i];
+    auto name = names[static_cast<int>(insn.op)];
+    switch (insn.op) {
+      case Op::ssp: case Op::ldc_i: case Op::lod: case Op::str:
+        fmt::format_to(it, "{} {}\n", name, insn.arg);
+        break;
+      case Op::ldc_c:
+        if (insn.arg == '\n') fmt::format_to(it, "{} '\\n'\n", name);
+        else fmt::format_to(it, "{} '{}'\n", name, static_cast<char>(insn.arg));
+        break;
+      case Op::fjp: case Op::ujp:
+        fmt::format_to(it, "{} L{}\n", name, name_at[insn.arg - base]);
+        break;
+      default:
+        fmt::format_to(it, "{}\n", name);
+    }
+  }
+}
+
+void Assembler::flush(std::string& out) {
+  render(out);
+  base = size();
+  code.clear();
+  origin_of.clear();
+  marks.clear();
+  label_base = label_count();
+  label_addr.clear();
+  pending.clear();
+}
@@ -0,0 +1,75 @@
+#ifndef ZPC_ASSEMBLER_H
+#define ZPC_ASSEMBLER_H
+#include <cstdint>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+// P-code instructions emitted by codegen. Integer operations carry the `i`
+// type tag when rendered; lod/str always address nesting level 0.
+enum class Op : uint8_t {
+  ssp, ldc_i, ldc_c, lod, str,
+  add, sub, mul, div, mod,
+  grt, les, geq, leq, equ, neq,
+  and_, or_, xor_, not_,
+  dpl, pop, fjp, ujp,
+  in, out_i, out_c, hlt,
+};
+
+struct Insn {
+  Op op;
+  int arg = 0; // constant, slot, or jump target address once bound
+};
+
+using Label = int;
+
+// Collects instructions into a flat buffer. Labels are integer handles; a
+// jump to a label that is not bound yet is chained and backpatched by bind().
+class Assembler {
+public:
+  Label new_label();
+  void bind(Label l);
+  int emit(Op op, int arg = 0);
+  void jump(Op op, Label l);
+  void patch(int addr, int arg) { code[addr - base].arg = arg; }
+  // Leaves `n` addresses for the caller to fill in outside the buffer.
+  void reserve(int n) { base += n; }
+
+  // Address of the next instruction.
+  int size() const { return base + static_cast<int>(code.size()); }
+  int label_count() const { return label_base + static_cast<int>(label_addr.size()); }
+  // Buffered instructions, starting at address size() - instructions().size().
+  const std::vector<Insn>& instructions() const { return code; }
+  // For each buffered instruction, the `origin` it was emitted under.
+  const std::vector<int>& origins() const { return origin_of; }
+
+  int origin = -1; // AST node the next instructions are generated for
+  // Records the next address as where the code of AST node `node` starts.
+  void mark(int node) { marks.push_back({node, size()}); }
+  // (node, address) pairs recorded by mark().
+  const std::vector<std::pair<int, int>>& entries() const { return marks; }
+
+  // Text P-code; every label must be bound.
+  std::string render() const;
+  void render(std::string& out) const;
+  // Appends `part`, assembled on its own from address 0, whose first labels
+  // stand for `externals` here and are never bound in it. Its other labels
+  // are numbered after ours in order, so the result is the same as
+  // assembling the code here directly.
+  void append(const Assembler& part, std::span<const Label> externals);
+
+  // Renders and drops the buffered code and labels. Addresses and label
+  // handles keep counting, so later code cannot jump back into it.
+  void flush(std::string& out);
+private:
+  std::vector<Insn> code;
+  std::vector<int> origin_of;
+  std::vector<std::pair<int, int>> marks;
+  int base = 0;
+  Label label_base = 0;
+  std::vector<int> label_addr;                // handle - label_base -> address, -1 while unbound
+  std::vector<std::vector<int>> pending;      // handle - label_base -> jumps waiting for bind()
+};
+
+#endif //ZPC_ASSEMBLER_H
@@ -1,58 +1,840 @@
 #include "ast.h"
-#include <cassert>
+#include "env.h"
+#include "thread.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
 
-std::string gen_label(const std::string& prefix) {
-  static int cnt = 0;
-  return prefix + std::to_string(cnt++);
+Ast* Ast::current = nullptr;
+
+const char* op_name(BinOp op) {
+  static const char* names[] = {"+", "-", "*", "/", "%", ">", "<", ">=", "<=", "==", "!=", "and", "or", "xor"};
+  return names[static_cast<int>(op)];
+}
+
+const char* op_name(UnOp op) {
+  static const char* names[] = {"++", "--", "not", "odd"};
+  return names[static_cast<int>(op)];
+}
+
+const char* kind_name(NodeKind kind) {
+  static const char* names[] = {
+    "EmptyExpr", "EmptyStmt", "Identifier", "BinaryOp", "UnaryOp", "Num",
+    "AssignStmt", "ReadStmt", "WriteStmt", "IfStmt", "StmtSequence", "ForStmt", "CaseStmt",
+    "BreakStmt", "ContinueStmt", "ExitStmt",
+  };
+  return names[static_cast<int>(kind)];
+}
+
+void Ast::clear() {
+  kinds.clear();
+  values.clear();
+  offsets.clear();
+  first.assign(1, 0);
+  child_ids.clear();
+  canons.clear();
+  consed.clear();
+  add(NodeKind::empty_expr, 0, {});
+  add(NodeKind::empty_stmt, 0, {});
+}
+
+NodeId Ast::add(NodeKind kind, int value, std::span<const NodeId> children) {
+  kinds.push_back(kind);
+  values.push_back(value);
+  offsets.push_back(children.empty() ? 0 : offsets[children[0]]);
+  child_ids.insert(child_ids.end(), children.begin(), children.end());
+  first.push_back(child_ids.size());
+  auto n = NodeId(kinds.size() - 1);
+
+  bool pure = kind == NodeKind::identifier || kind == NodeKind::num || kind == NodeKind::binary_op ||
+              (kind == NodeKind::unary_op && UnOp(value) != UnOp::inc && UnOp(value) != UnOp::dec);
+  for (auto c: children) pure = pure && canons[c] >= 0;
+  if (!pure) {
+    canons.push_back(-1);
+    return n;
+  }
+  std::array<int, 4> key{int(kind), value, -1, -1};
+  for (size_t i = 0; i < children.size(); ++i) key[i + 2] = canons[children[i]];
+  canons.push_back(consed.try_emplace(key, n).first->second);
+  return n;
 }
 
-std::string Identifier::gen(Env& env) const {
-  return fmt::format("lod i 0 {}\n", env.get_identifier(this));
+NodeId Ast::case_(NodeId e, const std::vector<std::pair<NodeId, NodeId>>& cases) {
+  std::vector<NodeId> c{e};
+  for (auto [v, s]: cases) c.insert(c.end(), {v, s});
+  return add(NodeKind::case_stmt, 0, c);
 }
 
-std::string UnaryOp::gen(Env &env) const {
-  if (op == "++" || op == "--") {
-    auto id = dynamic_cast<Identifier*>(expr);
-    if (id == nullptr) throw std::runtime_error(op + " should only used on variable.");
-    return AssignStmt(id, new BinaryOp(id, op.substr(1), new Num(1))).gen(env) + id->gen(env);
-  } else if (op == "not") {
-    return expr->gen(env) + "not\n";
-  } else if (op == "odd") {
-    return BinaryOp(new BinaryOp(expr, "mod", new Num(2)), "==", new Num(1)).gen(env);
+// Iterative, like gen_expr(): the text is built from a stack of pieces still
+// to print, so deep trees print in linear time and constant stack.
+std::string Ast::to_string(NodeId root) const {
+  struct Piece {
+    NodeId n; // -1 for literal text
+    int indent;
+    std::string text;
+  };
+  std::vector<Piece> todo{{root, 0, {}}}, pieces;
+  std::string s;
+  while (!todo.empty()) {
+    auto [n, indent, text] = std::move(todo.back());
+    todo.pop_back();
+    if (n < 0) {
+      s += text;
+      continue;
+    }
+    auto c = children(n);
+    pieces.clear();
+    auto put = [&](std::string t) { pieces.push_back({-1, 0, std::move(t)}); };
+    auto node = [&](NodeId m) { pieces.push_back({m, indent, {}}); };
+    switch (kind(n)) {
+      case NodeKind::empty_expr:
+      case NodeKind::empty_stmt:
+        break;
+      case NodeKind::identifier:
+        s += fmt::format("Identifier({})", global_symbols.name(value(n)));
+        break;
+      case NodeKind::binary_op:
+        put("("), node(c[0]), put(fmt::format(" {} ", op_name(BinOp(value(n))))), node(c[1]), put(")");
+        break;
+      case NodeKind::unary_op:
+        put(fmt::format("({} ", op_name(UnOp(value(n))))), node(c[0]), put(")");
+        break;
+      case NodeKind::num:
+        s += fmt::format("Num({})", value(n));
+        break;
+      case NodeKind::assign_stmt:
+        node(c[0]), put(" := "), node(c[1]);
+        break;
+      case NodeKind::read_stmt:
+        put("Read("), node(c[0]), put(")");
+        break;
+      case NodeKind::write_stmt:
+        put("Write("), node(c[0]), put(")");
+        break;
+      case NodeKind::if_stmt:
+        put("If(Cond: "), node(c[0]), put(", Then: "), node(c[1]), put(", Else: "), node(c[2]), put(")");
+        break;
+      case NodeKind::stmt_sequence:
+        put("{\n");
+        for (auto stmt: c) {
+          put(std::string(indent + 2, ' '));
+          pieces.push_back({stmt, indent + 2, {}});
+          put("\n");
+        }
+        put(std::string(indent, ' ') + "}");
+        break;
+      case NodeKind::for_stmt:
+        put("For(Init: "), node(c[0]), put(", Cond: "), node(c[1]), put(", Update: "), node(c[2]);
+        put(", Body: "), node(c[3]), put(")");
+        break;
+      case NodeKind::case_stmt:
+        put("Match("), node(c[0]), put(": ");
+        for (size_t i = 1; i < c.size(); i += 2) {
+          if (i > 1) put(", ");
+          node(c[i]), put(" => "), node(c[i + 1]);
+        }
+        put(")");
+        break;
+      case NodeKind::break_stmt: s += "Break"; break;
+      case NodeKind::continue_stmt: s += "Continue"; break;
+      case NodeKind::exit_stmt: s += "Exit"; break;
+    }
+    std::move(pieces.rbegin(), pieces.rend(), std::back_inserter(todo));
   }
-  assert(0);
+  return s;
 }
 
-std::string AssignStmt::gen(Env& env) const {
-  env.register_identifier(id);
-  int addr = env.get_identifier(id);
-  return expr->gen(env) + fmt::format("str i 0 {}\n", addr);
+// Sequences spanning fewer nodes are not worth a thread.
+static constexpr NodeId parallel_min_nodes = 1 << 12;
+// Nodes of loop body an unrolled loop may repeat, over all its copies.
+static constexpr int unroll_max_nodes = 128;
+
+// Entries of statement n in the profile, 0 without one.
+static uint64_t entries(const Env& env, NodeId n) {
+  return env.counts && size_t(n) < env.counts->size() ? (*env.counts)[n] : 0;
 }
 
-std::string StmtSequence::gen(Env& env) const {
-  std::string res;
-  for (auto stmt : stmts) res += stmt->gen(env);
-  return res;
+bool Ast::invertible(NodeId cond) const {
+  if (kind(cond) == NodeKind::unary_op) return UnOp(value(cond)) == UnOp::not_;
+  if (kind(cond) != NodeKind::binary_op) return false;
+  auto op = BinOp(value(cond));
+  return op >= BinOp::grt && op <= BinOp::neq;
 }
 
-std::string ForStmt::gen(Env& env) const {
+// Child index of every match arm's value, in the order they are tested.
+// With a profile, arms with distinct constant values are tested hottest
+// first; only one of them can match, so the order does not matter.
+std::vector<int> Ast::arm_order(NodeId n, const Env& env) const {
+  auto c = children(n);
+  std::vector<int> order;
+  for (size_t i = 1; i < c.size(); i += 2) order.push_back(int(i));
+  if (!env.counts) return order;
+  std::vector<int> values;
+  for (int i: order) {
+    if (kind(c[i]) != NodeKind::num) return order;
+    values.push_back(value(c[i]));
+  }
+  std::sort(values.begin(), values.end());
+  if (std::adjacent_find(values.begin(), values.end()) != values.end()) return order;
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return entries(env, c[a + 1]) > entries(env, c[b + 1]);
+  });
+  return order;
+}
+
+// A for loop `for ...; i op bound; i := i + step do body end` whose body
+// assigns neither i nor a variable of the bound, which is an expression
+// without side effects.
+struct CountedLoop {
+  int var;
+  BinOp op{};     // i op bound, one of grt .. leq, with step < 0 for grt and geq
+  NodeId bound{};
+  int64_t step{};
+  std::optional<int> first{}; // the constant the init assigns to i, if it does
+  int body_nodes{};
+};
+
+// Loops whose body is larger than max_nodes are not counted; looking at
+// them stops there.
+static std::optional<CountedLoop> counted_loop(const Ast& ast, NodeId n, int max_nodes) {
+  auto c = ast.children(n);
+  if (ast.kind(c[2]) != NodeKind::assign_stmt) return {};
+  auto u = ast.children(c[2]);
+  int var = ast.value(u[0]);
+  auto is_var = [&](NodeId e) { return ast.kind(e) == NodeKind::identifier && ast.value(e) == var; };
+  auto is_num = [&](NodeId e) { return ast.kind(e) == NodeKind::num; };
+  if (ast.kind(u[1]) != NodeKind::binary_op) return {};
+  auto e = ast.children(u[1]);
+  CountedLoop loop{var};
+  if (BinOp(ast.value(u[1])) == BinOp::add && is_var(e[0]) && is_num(e[1])) loop.step = ast.value(e[1]);
+  else if (BinOp(ast.value(u[1])) == BinOp::add && is_num(e[0]) && is_var(e[1])) loop.step = ast.value(e[0]);
+  else if (BinOp(ast.value(u[1])) == BinOp::sub && is_var(e[0]) && is_num(e[1])) loop.step = -int64_t(ast.value(e[1]));
+  else return {};
+
+  if (ast.kind(c[1]) != NodeKind::binary_op) return {};
+  loop.op = BinOp(ast.value(c[1]));
+  if (loop.op < BinOp::grt || loop.op > BinOp::leq) return {};
+  auto k = ast.children(c[1]);
+  if (is_var(k[0])) {
+    loop.bound = k[1];
+  } else if (is_var(k[1])) { // bound op i
+    static const BinOp mirror[] = {BinOp::les, BinOp::grt, BinOp::leq, BinOp::geq}; // grt .. leq
+    loop.bound = k[0];
+    loop.op = mirror[int(loop.op) - int(BinOp::grt)];
+  } else {
+    return {};
+  }
+  bool down = loop.op == BinOp::grt || loop.op == BinOp::geq;
+  if (loop.step == 0 || down != (loop.step < 0) || ast.canon(loop.bound) < 0) return {};
+
+  std::vector<int> fixed{var}; // symbols the loop must not assign
+  std::vector<NodeId> todo{loop.bound};
+  while (!todo.empty()) {
+    NodeId b = todo.back();
+    todo.pop_back();
+    if (is_var(b)) return {};
+    if (ast.kind(b) == NodeKind::identifier) fixed.push_back(ast.value(b));
+    auto d = ast.children(b);
+    todo.insert(todo.end(), d.begin(), d.end());
+  }
+  auto assigns_fixed = [&](NodeId id) { return std::find(fixed.begin(), fixed.end(), ast.value(id)) != fixed.end(); };
+  todo.push_back(c[3]);
+  loop.body_nodes = 0;
+  while (!todo.empty()) {
+    NodeId b = todo.back();
+    todo.pop_back();
+    if (++loop.body_nodes > max_nodes) return {};
+    auto d = ast.children(b);
+    bool assigns = ast.kind(b) == NodeKind::assign_stmt || ast.kind(b) == NodeKind::read_stmt ||
+                   (ast.kind(b) == NodeKind::unary_op && UnOp(ast.value(b)) <= UnOp::dec &&
+                    ast.kind(d[0]) == NodeKind::identifier);
+    if (assigns && assigns_fixed(d[0])) return {};
+    todo.insert(todo.end(), d.begin(), d.end());
+  }
+
+  if (ast.kind(c[0]) == NodeKind::assign_stmt) {
+    auto init = ast.children(c[0]);
+    if (is_var(init[0]) && is_num(init[1])) loop.first = ast.value(init[1]);
+  }
+  return loop;
+}
+
+// Assignments, reads and writes. A run of them in a sequence is
+// straight-line code, with one CSE plan.
+static bool straight_line(const Ast& ast, NodeId n) {
+  auto k = ast.kind(n);
+  return k == NodeKind::assign_stmt || k == NodeKind::read_stmt || k == NodeKind::write_stmt;
+}
+
+// Local value numbering over straight-line statements. An expression's
+// number is keyed by its canon and the numbers of its operands, and a
+// variable's by the assignments to it so far, so an assignment, ++, -- or
+// read invalidates every number computed from the old value. An expression
+// whose number was computed before loads it from the scratch slot the first
+// computation stored it to, or repeats it with dpl when it is the right
+// operand of an operator whose left operand is the same.
+static Env::CsePlan plan_cse(const Ast& ast, std::span<const NodeId> stmts) {
+  Env::CsePlan plan;
+  std::vector<NodeId> roots;
+  std::unordered_map<int, int> assigned;       // symbol -> assignments so far
+  std::unordered_map<std::array<int, 3>, int, KeyHash> numbers;
+  std::unordered_map<NodeId, int> number;      // node -> value number
+  int impure = 0;                              // numbers of their own, counting down
+  bool repeated = false;
+  for (auto stmt: stmts) {
+    auto c = ast.children(stmt);
+    if (ast.kind(stmt) == NodeKind::read_stmt) {
+      ++assigned[ast.value(c[0])];
+      continue;
+    }
+    NodeId root = c.back();
+    roots.push_back(root);
+    std::vector<std::pair<NodeId, bool>> todo{{root, false}}; // post order: node, operands numbered
+    while (!todo.empty()) {
+      auto [n, operands_done] = todo.back();
+      todo.pop_back();
+      auto d = ast.children(n);
+      if (!operands_done && !d.empty()) {
+        todo.push_back({n, true});
+        for (auto it = d.rbegin(); it != d.rend(); ++it) todo.push_back({*it, false});
+        continue;
+      }
+      NodeId canon = ast.canon(n);
+      if (canon < 0) {
+        if (ast.kind(n) == NodeKind::unary_op && (UnOp(ast.value(n)) == UnOp::inc || UnOp(ast.value(n)) == UnOp::dec))
+          ++assigned[ast.value(d[0])];
+        number[n] = --impure;
+        continue;
+      }
+      repeated = repeated || (!d.empty() && canon != n);
+      std::array<int, 3> key{canon, 0, 0};
+      if (ast.kind(n) == NodeKind::identifier) key[1] = assigned[ast.value(n)];
+      for (size_t i = 0; i < d.size(); ++i) key[i + 1] = number[d[i]];
+      number[n] = numbers.try_emplace(key, int(numbers.size())).first->second;
+    }
+    if (ast.kind(stmt) == NodeKind::assign_stmt) ++assigned[ast.value(c[0])];
+  }
+  if (!repeated) return plan; // no operator expression occurs twice
+
+  std::unordered_map<int, NodeId> first;  // value number -> node computing it first
+  std::unordered_map<NodeId, int> temp_of; // first node -> scratch index
+  struct Visit {
+    NodeId n;
+    bool dpl;      // right operand equal to the left one
+    bool computed; // post order: the value is now available
+  };
+  for (auto root: roots) {
+    std::vector<Visit> todo{{root, false, false}};
+    while (!todo.empty()) {
+      auto [n, dpl, computed] = todo.back();
+      todo.pop_back();
+      auto d = ast.children(n);
+      if (computed) {
+        first.try_emplace(number[n], n);
+        continue;
+      }
+      // A reload costs as much as lod or ldc. Only integers are reused:
+      // Pmachine types dpl, str and lod, and the assembler emits them for
+      // integers.
+      if (ast.kind(n) != NodeKind::binary_op || BinOp(ast.value(n)) > BinOp::mod) {
+        if (!d.empty()) {
+          todo.push_back({n, false, true});
+          for (auto it = d.rbegin(); it != d.rend(); ++it) todo.push_back({*it, false, false});
+        }
+        continue;
+      }
+      if (dpl) {
+        plan.reuse[n] = {-1, false};
+        continue;
+      }
+      if (auto it = first.find(number[n]); it != first.end()) {
+        auto [t, added] = temp_of.try_emplace(it->second, plan.temps);
+        if (added) plan.reuse[it->second] = {plan.temps++, true};
+        plan.reuse[n] = {t->second, false};
+        continue;
+      }
+      todo.push_back({n, false, true});
+      todo.push_back({d[1], number[d[0]] == number[d[1]], false});
+      todo.push_back({d[0], false, false});
+    }
+  }
+  return plan;
+}
+
+// Lowers a run of straight-line statements, computing common
+// subexpressions once.
+void Ast::gen_block(std::span<const NodeId> stmts, Env& env) const {
+  auto plan = plan_cse(*this, stmts);
+  if (plan.temps) env.temp(plan.temps - 1);
+  auto outer = std::exchange(env.cse, &plan);
+  for (auto stmt: stmts) gen(stmt, env);
+  env.cse = outer;
+}
+
+// Lowers the negation of an invertible condition without an extra `not`.
+void Ast::gen_inverted(NodeId cond, Env& env) const {
+  static const Op inverse[] = {Op::leq, Op::geq, Op::les, Op::grt, Op::neq, Op::equ}; // grt .. neq
+  auto c = children(cond);
+  int outer = std::exchange(env.code.origin, cond);
+  if (kind(cond) == NodeKind::unary_op) {
+    gen(c[0], env);
+  } else {
+    gen(c[0], env);
+    gen(c[1], env);
+    env.code.emit(inverse[value(cond) - int(BinOp::grt)]);
+  }
+  env.code.origin = outer;
+}
+
+// Lowers counted loop n with env.unroll copies of the body per pass, or
+// with one copy per trip and no test at all when the trip count is known and
+// small; false, emitting nothing, if n is not worth unrolling. Every copy
+// runs the update, so the body sees i as it would in the rolled loop, and
+// `continue` goes to the update of its own copy. Trips that do not fill a
+// pass run one at a time in the rolled loop the copies hang off.
+bool Ast::gen_unrolled(NodeId n, Env& env) const {
+  static constexpr int64_t int_min = std::numeric_limits<int>::min(), int_max = std::numeric_limits<int>::max();
+  auto fits = [](int64_t v) { return int_min <= v && v <= int_max; };
+  if (env.unroll <= 1 || (env.counts && !entries(env, n))) return false; // cold in the profile
+  auto loop = counted_loop(*this, n, unroll_max_nodes / 2);
+  if (!loop) return false;
+  auto c = children(n);
+
+  int64_t trips = -1;
+  if (loop->first && kind(loop->bound) == NodeKind::num) {
+    int64_t from = *loop->first, to = value(loop->bound), step = loop->step;
+    if (step < 0) std::swap(from, to), step = -step;
+    bool strict = loop->op == BinOp::les || loop->op == BinOp::grt;
+    int64_t span = to - from + !strict; // values of i the test accepts
+    trips = span <= 0 ? 0 : (span + step - 1) / step;
+    if (!fits(*loop->first + trips * loop->step)) trips = -1; // i wraps around
+  }
+
+  if (trips >= 0 && trips * loop->body_nodes <= unroll_max_nodes) {
+    env.open_loop();
+    auto end_label = env.get_loop_end();
+    gen(c[0], env);
+    int addr = env.get_identifier(loop->var);
+    if (!trips) {
+      assign_slots(c[3], env);
+      env.code.bind(env.get_loop_start());
+    }
+    for (int64_t k = 1; k <= trips; ++k) {
+      if (k > 1) env.set_loop_start(env.code.new_label());
+      gen(c[3], env);
+      env.code.bind(env.get_loop_start());
+      int outer = std::exchange(env.code.origin, c[2]);
+      env.code.mark(c[2]);
+      env.code.emit(Op::ldc_i, int(*loop->first + k * loop->step));
+      env.code.emit(Op::str, addr);
+      env.code.origin = outer;
+    }
+    env.code.bind(end_label);
+    env.close_loop();
+    return true;
+  }
+
+  // Passes over the copies need the test to hold for the last of them:
+  // i + reach op bound.
+  int copies = env.unroll;
+  int64_t reach = (copies - 1) * loop->step;
+  if (loop->body_nodes * (copies + 1) > unroll_max_nodes || (trips >= 0 && trips < copies) || !fits(std::abs(reach)))
+    return false;
+  if (env.counts && entries(env, c[3]) < uint64_t(copies) * entries(env, n)) return false; // few trips per entry
+  bool constant = kind(loop->bound) == NodeKind::num;
+  if (constant && !fits(value(loop->bound) - reach)) return false;
+
   env.open_loop();
-  auto continue_label = env.get_loop_start();
-  auto end_label = env.get_loop_end();
-  auto start_label = gen_label("if");
-  auto res = s1->gen(env) + fmt::format("{}:\n", start_label) +
-             s2->gen(env) + fmt::format("fjp {}\n", end_label) +
-             s4->gen(env) + fmt::format("{}:\n", continue_label) +
-             s3->gen(env) + fmt::format("ujp {}\n", start_label) +
-             fmt::format("{}:\n", end_label);
+  auto continue_label = env.get_loop_start(), end_label = env.get_loop_end();
+  auto head = env.code.new_label(), unrolled = env.code.new_label();
+  // Jumps to the copies if there is room for a pass: i op bound - reach for
+  // a constant bound, else the distance from i to the bound against reach.
+  // The distance is taken where i op bound holds, or held before the last
+  // pass, so it overflows only when it is larger than any int.
+  auto room = [&] {
+    static const Op inverse[] = {Op::leq, Op::geq, Op::les, Op::grt}; // grt .. leq
+    int outer = std::exchange(env.code.origin, c[1]);
+    int addr = env.get_identifier(loop->var);
+    if (constant) {
+      env.code.emit(Op::lod, addr);
+      env.code.emit(Op::ldc_i, int(value(loop->bound) - reach));
+      env.code.emit(inverse[int(loop->op) - int(BinOp::grt)]);
+    } else {
+      if (loop->step > 0) {
+        gen(loop->bound, env);
+        env.code.emit(Op::lod, addr);
+      } else {
+        env.code.emit(Op::lod, addr);
+        gen(loop->bound, env);
+      }
+      env.code.emit(Op::sub);
+      env.code.emit(Op::ldc_i, int(std::abs(reach)));
+      env.code.emit(loop->op == BinOp::les || loop->op == BinOp::grt ? Op::leq : Op::les);
+    }
+    env.code.jump(Op::fjp, unrolled);
+    env.code.origin = outer;
+  };
+  gen(c[0], env);
+  env.code.bind(head);
+  gen(c[1], env);
+  env.code.jump(Op::fjp, end_label);
+  room();
+  gen(c[3], env);
+  env.code.bind(continue_label);
+  gen(c[2], env);
+  env.code.jump(Op::ujp, head);
+  env.code.bind(unrolled);
+  for (int k = 0; k < copies; ++k) {
+    env.set_loop_start(env.code.new_label());
+    gen(c[3], env);
+    env.code.bind(env.get_loop_start());
+    gen(c[2], env);
+  }
+  room();
+  env.code.jump(Op::ujp, head);
+  env.code.bind(end_label);
   env.close_loop();
-  return res;
+  return true;
+}
+
+void Ast::gen(NodeId n, Env& env) const {
+  if (!env.cse && straight_line(*this, n)) return gen_block({&n, 1}, env);
+  auto c = children(n);
+  int outer = std::exchange(env.code.origin, n);
+  if (kind(n) >= NodeKind::assign_stmt && n > empty_stmt) env.code.mark(n);
+  switch (kind(n)) {
+    case NodeKind::empty_expr:
+    case NodeKind::empty_stmt:
+      break;
+
+    case NodeKind::identifier:
+    case NodeKind::binary_op:
+    case NodeKind::unary_op:
+    case NodeKind::num:
+      gen_expr(n, env);
+      break;
+
+    case NodeKind::assign_stmt: {
+      env.register_identifier(value(c[0]));
+      int addr = env.get_identifier(value(c[0]));
+      gen(c[1], env);
+      env.code.emit(Op::str, addr);
+      break;
+    }
+
+    case NodeKind::read_stmt: {
+      env.code.emit(Op::in);
+      env.register_identifier(value(c[0]));
+      env.code.emit(Op::str, env.get_identifier(value(c[0])));
+      break;
+    }
+
+    case NodeKind::write_stmt:
+      gen(c[0], env);
+      env.code.emit(Op::out_i);
+      env.code.emit(Op::ldc_c, '\n');
+      env.code.emit(Op::out_c);
+      break;
+
+    case NodeKind::if_stmt: {
+      auto else_label = env.code.new_label(), end_label = env.code.new_label();
+      if (2 * entries(env, c[1]) > entries(env, n) && invertible(c[0])) {
+        // Hot then-branch last: the taken fjp reaches it without a ujp after
+        // it. Slots and errors still follow source order.
+        gen_inverted(c[0], env);
+        assign_slots(c[1], env);
+        env.code.jump(Op::fjp, else_label);
+        gen(c[2], env);
+        env.code.jump(Op::ujp, end_label);
+        env.code.bind(else_label);
+        gen(c[1], env);
+        env.code.bind(end_label);
+        break;
+      }
+      gen(c[0], env);
+      env.code.jump(Op::fjp, else_label);
+      gen(c[1], env);
+      env.code.jump(Op::ujp, end_label);
+      env.code.bind(else_label);
+      gen(c[2], env);
+      env.code.bind(end_label);
+      break;
+    }
+
+    case NodeKind::stmt_sequence:
+      if (env.jobs > 1 && c.size() > 1 && c.back() - c.front() >= parallel_min_nodes) {
+        gen_parallel(n, env);
+        break;
+      }
+      for (size_t i = 0, j; i < c.size(); i = j) {
+        for (j = i; j < c.size() && straight_line(*this, c[j]); ++j) {}
+        if (j == i) gen(c[j++], env);
+        else gen_block(c.subspan(i, j - i), env);
+      }
+      break;
+
+    case NodeKind::for_stmt: { // for (s1; s2; s3) s4
+      if (gen_unrolled(n, env)) break;
+      env.open_loop();
+      auto continue_label = env.get_loop_start();
+      auto end_label = env.get_loop_end();
+      auto start_label = env.code.new_label();
+      gen(c[0], env);
+      if (entries(env, c[3]) > entries(env, n) && invertible(c[1])) {
+        // Rotated for hot loops: the test sits at the bottom and jumps back,
+        // saving the ujp of every iteration. Slots and errors still follow
+        // source order.
+        assign_slots(c[1], env);
+        auto test_label = env.code.new_label();
+        env.code.jump(Op::ujp, test_label);
+        env.code.bind(start_label);
+        gen(c[3], env);
+        env.code.bind(continue_label);
+        gen(c[2], env);
+        env.code.bind(test_label);
+        gen_inverted(c[1], env);
+        env.code.jump(Op::fjp, start_label);
+        env.code.bind(end_label);
+        env.close_loop();
+        break;
+      }
+      env.code.bind(start_label);
+      gen(c[1], env);
+      env.code.jump(Op::fjp, end_label);
+      gen(c[3], env);
+      env.code.bind(continue_label);
+      gen(c[2], env);
+      env.code.jump(Op::ujp, start_label);
+      env.code.bind(end_label);
+      env.close_loop();
+      break;
+    }
+
+    case NodeKind::case_stmt: {
+      auto end_label = env.code.new_label();
+      auto next_label = env.code.new_label();
+      gen(c[0], env);
+      ++env.held;
+      auto order = arm_order(n, env);
+      if (!std::is_sorted(order.begin(), order.end()))
+        for (size_t i = 2; i < c.size(); i += 2) assign_slots(c[i], env);
+      for (int i: order) {
+        env.code.bind(next_label);
+        next_label = env.code.new_label();
+        env.code.emit(Op::dpl);
+        gen(c[i], env);
+        env.code.emit(Op::equ);
+        env.code.jump(Op::fjp, next_label);
+        gen(c[i + 1], env);
+        env.code.jump(Op::ujp, end_label);
+      }
+      env.code.bind(next_label);
+      env.code.bind(end_label);
+      env.code.emit(Op::pop);
+      --env.held;
+      break;
+    }
+
+    case NodeKind::break_stmt:
+      for (int k = env.loop_unwind(); k > 0; --k) env.code.emit(Op::pop);
+      env.code.jump(Op::ujp, env.get_loop_end());
+      break;
+
+    case NodeKind::continue_stmt:
+      for (int k = env.loop_unwind(); k > 0; --k) env.code.emit(Op::pop);
+      env.code.jump(Op::ujp, env.get_loop_start());
+      break;
+
+    case NodeKind::exit_stmt:
+      env.code.emit(Op::hlt);
+      break;
+  }
+  env.code.origin = outer;
 }
 
-std::string BreakStmt::gen(Env &env) const {
-  return fmt::format("ujp {}\n", env.get_loop_end());
+// Expressions are lowered in post order from an explicit stack rather than
+// by recursion: a chain of n operators is a tree n deep.
+void Ast::gen_expr(NodeId root, Env& env) const {
+  static const Op codes[] = {
+    Op::add, Op::sub, Op::mul, Op::div, Op::mod,
+    Op::grt, Op::les, Op::geq, Op::leq, Op::equ, Op::neq,
+    Op::and_, Op::or_, Op::xor_,
+  };
+  int outer = env.code.origin;
+  std::vector<std::pair<NodeId, bool>> todo{{root, false}}; // node, operands done
+  while (!todo.empty()) {
+    auto [n, operands_done] = todo.back();
+    todo.pop_back();
+    auto c = children(n);
+    env.code.origin = n;
+    const Env::Reuse* reuse = nullptr;
+    if (env.cse && !c.empty()) {
+      auto it = env.cse->reuse.find(n);
+      if (it != env.cse->reuse.end()) reuse = &it->second;
+    }
+    if (operands_done) {
+      if (kind(n) == NodeKind::binary_op) {
+        env.code.emit(codes[value(n)]);
+      } else if (UnOp(value(n)) == UnOp::not_) {
+        env.code.emit(Op::not_);
+      } else { // odd: (e % 2) == 1
+        env.code.emit(Op::ldc_i, 2);
+        env.code.emit(Op::mod);
+        env.code.emit(Op::ldc_i, 1);
+        env.code.emit(Op::equ);
+      }
+      if (reuse) { // computed again later in the block
+        env.code.emit(Op::dpl);
+        env.code.emit(Op::str, env.temp(reuse->temp));
+      }
+      continue;
+    }
+    if (reuse && !reuse->store) {
+      if (reuse->temp < 0) env.code.emit(Op::dpl);
+      else env.code.emit(Op::lod, env.temp(reuse->temp));
+      continue;
+    }
+    switch (kind(n)) {
+      case NodeKind::identifier:
+        env.code.emit(Op::lod, env.get_identifier(value(n)));
+        break;
+      case NodeKind::num:
+        env.code.emit(Op::ldc_i, value(n));
+        break;
+      case NodeKind::binary_op:
+        todo.push_back({n, true});
+        todo.push_back({c[1], false});
+        todo.push_back({c[0], false});
+        break;
+      case NodeKind::unary_op:
+        if (UnOp(value(n)) == UnOp::inc || UnOp(value(n)) == UnOp::dec) { // id := id +/- 1, then the new value
+          if (kind(c[0]) != NodeKind::identifier)
+            throw std::runtime_error(std::string(op_name(UnOp(value(n)))) + " should only used on variable.");
+          int sym = value(c[0]);
+          env.register_identifier(sym);
+          int addr = env.get_identifier(sym);
+          env.code.origin = c[0];
+          env.code.emit(Op::lod, env.get_identifier(sym));
+          env.code.origin = n;
+          env.code.emit(Op::ldc_i, 1);
+          env.code.emit(UnOp(value(n)) == UnOp::inc ? Op::add : Op::sub);
+          env.code.emit(Op::str, addr);
+          env.code.origin = c[0];
+          env.code.emit(Op::lod, env.get_identifier(sym));
+          break;
+        }
+        todo.push_back({n, true});
+        todo.push_back({c[0], false});
+        break;
+      default:
+        break;
+    }
+  }
+  env.code.origin = outer;
 }
 
-std::string ContinueStmt::gen(Env &env) const {
-  return fmt::format("ujp {}\n", env.get_loop_start());
-}
\ No newline at end of file
+// Splits the statements of sequence n into about env.jobs chunks of the same
+// number of nodes (statements are built in order, so the id gap between two
+// statements measures the second) and lowers them on separate threads. Slots are assigned beforehand in
+// serial order and the chunks are joined in order, so the code is the same
+// as lowering the statements one after another.
+void Ast::gen_parallel(NodeId n, Env& env) const {
+  auto c = children(n);
+  // Runs of straight-line statements keep one CSE plan across chunks.
+  std::vector<Env::CsePlan> plans;
+  std::vector<int> plan_of(c.size(), -1);
+  for (size_t i = 0, j; i < c.size(); i = j) {
+    for (j = i; j < c.size() && straight_line(*this, c[j]); ++j) plan_of[j] = int(plans.size());
+    if (j == i) ++j;
+    else plans.push_back(plan_cse(*this, c.subspan(i, j - i)));
+  }
+  for (size_t i = 0; i < c.size(); ++i) {
+    int p = plan_of[i];
+    if (p >= 0 && (i == 0 || plan_of[i - 1] != p) && plans[p].temps) env.temp(plans[p].temps - 1);
+    assign_slots(c[i], env);
+  }
+
+  // A statement as large as a whole chunk gets a chunk of its own.
+  NodeId target = (c.back() - c.front()) / env.jobs + 1, filled = 0;
+  std::vector<size_t> cuts{0};
+  for (size_t i = 1; i < c.size(); ++i) {
+    NodeId cost = c[i] - c[i - 1];
+    if (filled >= target || cost >= target) cuts.push_back(i), filled = 0;
+    filled += cost;
+  }
+  cuts.push_back(c.size());
+
+  std::vector<Env> parts;
+  for (size_t k = 0; k + 1 < cuts.size(); ++k) {
+    parts.push_back(env.fork());
+    // A chunk of one statement is one big loop or branch; its body may split further.
+    if (cuts[k + 1] - cuts[k] == 1) parts.back().jobs = env.jobs;
+  }
+  auto lower = [&](size_t k) {
+    for (size_t i = cuts[k]; i < cuts[k + 1]; ++i) {
+      parts[k].cse = plan_of[i] < 0 ? nullptr : &plans[plan_of[i]];
+      gen(c[i], parts[k]);
+    }
+    parts[k].cse = nullptr;
+  };
+  std::vector<std::unique_ptr<StackThread>> done;
+  for (size_t k = 1; k < parts.size(); ++k)
+    done.push_back(std::make_unique<StackThread>(env.stack_bytes, [&, k] { lower(k); }));
+  lower(0);
+  for (auto& t: done) t->join();
+  for (auto& part: parts) env.join(part);
+}
+
+void Ast::assign_slots(NodeId root, Env& env) const {
+  std::vector<NodeId> todo{root}; // pre order, next last; ~k where gen() reserves k scratch slots
+  auto reserve = [&](std::span<const NodeId> block) { todo.push_back(~plan_cse(*this, block).temps); };
+  while (!todo.empty()) {
+    NodeId n = todo.back();
+    todo.pop_back();
+    if (n < 0) {
+      if (~n) env.temp(~n - 1);
+      continue;
+    }
+    auto c = children(n);
+    switch (kind(n)) {
+      case NodeKind::identifier:
+        env.get_identifier(value(n));
+        break;
+      case NodeKind::unary_op:
+        if (UnOp(value(n)) == UnOp::inc || UnOp(value(n)) == UnOp::dec) {
+          if (kind(c[0]) != NodeKind::identifier)
+            throw std::runtime_error(std::string(op_name(UnOp(value(n)))) + " should only used on variable.");
+          env.register_identifier(value(c[0]));
+        }
+        todo.push_back(c[0]);
+        break;
+      case NodeKind::assign_stmt:
+      case NodeKind::read_stmt:
+        env.register_identifier(value(c[0]));
+        if (c.size() > 1) todo.push_back(c[1]);
+        break;
+      case NodeKind::for_stmt: // lowered as init, cond, body, update
+        for (int i: {2, 3, 1, 0}) {
+          todo.push_back(c[i]);
+          if (straight_line(*this, c[i])) reserve(c.subspan(i, 1));
+        }
+        break;
+      case NodeKind::stmt_sequence:
+        for (size_t j = c.size(), i; j > 0; j = i) {
+          for (i = j; i > 0 && straight_line(*this, c[i - 1]); --i) {}
+          if (i == j) {
+            todo.push_back(c[--i]);
+            continue;
+          }
+          todo.insert(todo.end(), c.rbegin() + (c.size() - j), c.rbegin() + (c.size() - i));
+          reserve(c.subspan(i, j - i));
+        }
+        break;
+      default:
+        todo.insert(todo.end(), c.rbegin(), c.rend());
+    }
+  }
+}
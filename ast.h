@@ -2,206 +2,124 @@
 #define ZPC_AST_H
 
 #include <fmt/format.h>
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+#include <span>
 #include <string>
-#include <map>
-#include <ranges>
-#include <numeric>
-#include "env.h"
-
-std::string gen_label(const std::string& prefix = "L");
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "interner.h"
 
 class Env;
 
-struct Node {
-  virtual std::string to_string() const = 0;
-  virtual std::string gen(Env&) const = 0;
-};
-
-struct Expr : Node {};
-struct Stmt : Node {};
-
-struct EmptyExpr : Expr {
-  EmptyExpr() {}
-  std::string to_string() const override { return {}; }
-  std::string gen(Env&) const override { return {}; }
-};
-static EmptyExpr *empty_expr = new EmptyExpr{};
-
-struct EmptyStmt : Stmt {
-  EmptyStmt() {}
-  std::string to_string() const override { return {}; }
-  std::string gen(Env&) const override { return {}; }
-};
-static EmptyStmt *empty_stmt = new EmptyStmt{};
-
-struct Identifier : Expr {
-  explicit Identifier(std::string s) : name(std::move(s)) {}
-  std::string name;
-  std::string to_string() const override {
-    return fmt::format("Identifier({})", name);
-  }
-  std::string gen(Env& env) const override;
-};
-
-struct BinaryOp : Expr {
-  std::string op;
-  Expr *lhs, *rhs;
-  BinaryOp(Expr* lhs, std::string op, Expr* rhs): lhs(lhs), op(std::move(op)), rhs(rhs) {}
-
-  std::string to_string() const override {
-    return fmt::format("({} {} {})", lhs->to_string(), op, rhs->to_string());
-  }
-  std::string gen(Env& env) const override {
-    static std::map<std::string, std::string> op_map = {
-        {"+", "add"}, {"-", "sub"}, {"*", "mul"}, {"/", "div"},
-        {">", "grt"}, {"<", "les"}, {">=", "geq"}, {"<=", "leq"}, {"==", "equ"}, {"!=", "neq"},
-    };
-    auto code = op_map.count(op) ? op_map[op] + " i\n" : op + "\n";
-    return lhs->gen(env) + rhs->gen(env) + code;
-  }
-};
-
-struct UnaryOp : Expr {
-  std::string op;
-  Expr* expr;
-  UnaryOp(std::string op, Expr* expr): op(std::move(op)), expr(expr) {}
-
-  std::string to_string() const override {
-    return fmt::format("({} {})", op, expr->to_string());
-  }
-  std::string gen(Env& env) const override;
-};
-
-struct Num : Expr {
-  int v;
-  explicit Num(int v): v(v) {}
-  std::string to_string() const override {
-    return fmt::format("Num({})", v);
-  }
-  std::string gen(Env&) const override {
-    return fmt::format("ldc i {}\n", v);
-  }
-};
-
-
-
-struct AssignStmt : Stmt {
-  Identifier *id;
-  Expr *expr;
-  AssignStmt(Expr* id, Expr* expr): id(dynamic_cast<Identifier*>(id)), expr(expr) {}
-  std::string to_string() const override {
-    return fmt::format("{} := {}", id->to_string(), expr->to_string());
-  }
-  std::string gen(Env& env) const override;
-};
-
-struct ReadStmt : Stmt {
-  Identifier *id;
-  explicit ReadStmt(Expr *id): id(dynamic_cast<Identifier*>(id)) {}
-  std::string to_string() const override {
-    return fmt::format("Read({})", id->to_string());
-  }
-  std::string gen(Env& env) const override {
-    return fmt::format("in i\n") + AssignStmt(id, empty_expr).gen(env);
-  }
-};
-
-struct WriteStmt : Stmt {
-  Expr *expr;
-  explicit WriteStmt(Expr *exp): expr(exp) {}
-  std::string to_string() const override {
-    return fmt::format("Write({})", expr->to_string());
-  }
-  std::string gen(Env& env) const override {
-    return expr->gen(env) + "out i\nldc c '\\n'\nout c\n";
-  }
-};
-
-struct IfStmt : Stmt {
-  Expr *expr;
-  Stmt *s1, *s2;
-  IfStmt(Expr *expr, Stmt *s1, Stmt *s2): expr(expr), s1(s1), s2(s2) {}
-  std::string to_string() const override {
-    return fmt::format("If(Cond: {}, Then: {}, Else: {})", expr->to_string(), s1->to_string(), s2->to_string());
-  }
-  std::string gen(Env& env) const override {
-    auto else_label = gen_label("if"), end_label = gen_label("if");
-    return expr->gen(env) + fmt::format("fjp {}\n", else_label) + s1->gen(env) + fmt::format("ujp {}\n", end_label) +
-           fmt::format("{}:\n", else_label) + s2->gen(env) + fmt::format("{}:\n", end_label);
-  }
-};
-
-struct StmtSequence : Stmt {
-  std::vector<Stmt*> stmts;
-  explicit StmtSequence(const std::vector<Stmt*>& stmts): stmts(stmts) {}
-  std::string to_string() const override {
-    static int indent = 0;
-    std::string s;
-    s += "{\n";
-    indent += 2;
-    for (auto& stmt: stmts) s += std::string(indent, ' ') + stmt->to_string() + '\n';
-    indent -= 2;
-    s += std::string(indent, ' ') + "}";
-    return s;
-  }
-  std::string gen(Env& env) const override;
-};
-
-struct ForStmt : Stmt { // for (s1; s2; s3) s4
-  Stmt *s1, *s3, *s4;
-  Expr *s2;
-  ForStmt(Stmt* s1, Expr* s2, Stmt* s3, Stmt* s4): s1(s1), s2(s2), s3(s3), s4(s4) {}
-  std::string to_string() const override {
-    return fmt::format("For(Init: {}, Cond: {}, Update: {}, Body: {})",
-                       s1->to_string(), s2->to_string(), s3->to_string(), s4->to_string());
-  }
-  std::string gen(Env& env) const override;
-};
-
-struct CaseStmt : Stmt {
-  Expr *expr;
-  std::vector<std::pair<Expr*, Stmt*>> cases;
-  CaseStmt(Expr* expr, const std::vector<std::pair<Expr*, Stmt*>>& cases): expr(expr), cases(cases) {}
-  std::string to_string() const override {
-    std::string cs;
-    for (int i = 0; i < cases.size(); ++i) {
-      if (i) cs += ", ";
-      cs += fmt::format("{} => {}", cases[i].first->to_string(), cases[i].second->to_string());
-    }
-    return fmt::format("Match({}: {})", expr->to_string(), cs);
-  }
-
-  std::string gen(Env& env) const override {
-    auto end_label = gen_label("case_end");
-    auto next_label = gen_label("case");
-    auto res = expr->gen(env);
-    for (auto& c: cases) {
-      res += fmt::format("{}:\n", next_label);
-      next_label = gen_label("case");
-      res += "dpl i\n" + c.first->gen(env) + "equ i\n";
-      res += fmt::format("fjp {}\n", next_label);
-      res += c.second->gen(env);
-      res += fmt::format("ujp {}\n", end_label);
-    }
-    res += "pop\n";
-    res += fmt::format("{}:\n{}:\n", next_label, end_label);
-    return res;
-  }
-};
-
-struct BreakStmt : Stmt {
-  std::string to_string() const override { return "Break"; }
-  std::string gen(Env& env) const override;
-};
-
-struct ContinueStmt : Stmt {
-  std::string to_string() const override { return "Continue"; }
-  std::string gen(Env& env) const override;
-};
-
-struct ExitStmt : Stmt {
-  std::string to_string() const override { return "Exit"; }
-  std::string gen(Env& env) const override { return "hlt\n"; }
+struct KeyHash {
+  template<size_t N>
+  size_t operator () (const std::array<int, N>& key) const {
+    uint64_t h = 0;
+    for (int k: key) h = (h ^ uint32_t(k)) * 0x9e3779b97f4a7c15;
+    return h ^ (h >> 29);
+  }
+};
+
+enum class BinOp { add, sub, mul, div, mod, grt, les, geq, leq, equ, neq, and_, or_, xor_ };
+enum class UnOp { inc, dec, not_, odd };
+
+const char* op_name(BinOp op);
+const char* op_name(UnOp op);
+
+enum class NodeKind : uint8_t {
+  empty_expr, empty_stmt, identifier, binary_op, unary_op, num,
+  assign_stmt, read_stmt, write_stmt, if_stmt, stmt_sequence, for_stmt, case_stmt,
+  break_stmt, continue_stmt, exit_stmt,
+};
+
+const char* kind_name(NodeKind kind);
+
+using NodeId = int32_t;
+
+// Every Ast starts with these two leaf nodes.
+constexpr NodeId empty_expr = 0, empty_stmt = 1;
+
+// Struct-of-arrays syntax tree. Node n is kinds[n], with one int of payload
+// (literal value, symbol id or operator), the source offset it starts at and
+// the children child_ids[first[n] .. first[n + 1]). Children are always built before their
+// parent, so a node's child range is appended when the node is.
+//
+// Children by kind:
+//   binary_op, assign_stmt  lhs/id, rhs/expr
+//   unary_op, read_stmt, write_stmt  operand
+//   if_stmt                 cond, then, else
+//   stmt_sequence           statements
+//   for_stmt                init, cond, update, body
+//   case_stmt               expr, then (value, body) per case
+class Ast {
+public:
+  Ast() { clear(); }
+
+  NodeId identifier(int sym) { return add(NodeKind::identifier, sym, {}); }
+  NodeId num(int v) { return add(NodeKind::num, v, {}); }
+  NodeId binary(NodeId lhs, BinOp op, NodeId rhs) { return add(NodeKind::binary_op, int(op), {lhs, rhs}); }
+  NodeId unary(UnOp op, NodeId e) { return add(NodeKind::unary_op, int(op), {e}); }
+  NodeId assign(NodeId id, NodeId e) { return add(NodeKind::assign_stmt, 0, {id, e}); }
+  NodeId read(NodeId id) { return add(NodeKind::read_stmt, 0, {id}); }
+  NodeId write(NodeId e) { return add(NodeKind::write_stmt, 0, {e}); }
+  NodeId if_(NodeId cond, NodeId s1, NodeId s2) { return add(NodeKind::if_stmt, 0, {cond, s1, s2}); }
+  NodeId sequence(std::span<const NodeId> stmts) { return add(NodeKind::stmt_sequence, 0, stmts); }
+  NodeId for_(NodeId s1, NodeId s2, NodeId s3, NodeId s4) { return add(NodeKind::for_stmt, 0, {s1, s2, s3, s4}); }
+  NodeId case_(NodeId e, const std::vector<std::pair<NodeId, NodeId>>& cases);
+  NodeId break_() { return add(NodeKind::break_stmt, 0, {}); }
+  NodeId continue_() { return add(NodeKind::continue_stmt, 0, {}); }
+  NodeId exit() { return add(NodeKind::exit_stmt, 0, {}); }
+
+  NodeKind kind(NodeId n) const { return kinds[n]; }
+  int value(NodeId n) const { return values[n]; }
+  // Byte offset in the source; nodes start where their first child does
+  // until the parser locates them.
+  uint32_t offset(NodeId n) const { return offsets[n]; }
+  // Expressions without side effects are hash-consed as they are built: this
+  // is the first node of the same expression, or n itself; -1 for statements
+  // and for expressions with ++ or --. Nodes are not merged, so that each
+  // keeps its own source offset.
+  NodeId canon(NodeId n) const { return canons[n]; }
+  void locate(NodeId n, uint32_t offset) { if (n > empty_stmt) offsets[n] = offset; }
+  std::span<const NodeId> children(NodeId n) const {
+    return {child_ids.data() + first[n], child_ids.data() + first[n + 1]};
+  }
+  size_t size() const { return kinds.size(); }
+  // Drops every node but the two empty ones.
+  void clear();
+
+  std::string to_string(NodeId n) const;
+  void gen(NodeId n, Env& env) const;
+  // Registers the variables and scratch slots gen(n) would, in the same
+  // order, without emitting code; throws the same errors.
+  void assign_slots(NodeId n, Env& env) const;
+
+  static Ast* current; // where the parser builds nodes
+private:
+  NodeId add(NodeKind kind, int value, std::initializer_list<NodeId> children) {
+    return add(kind, value, std::span<const NodeId>(children.begin(), children.size()));
+  }
+  NodeId add(NodeKind kind, int value, std::span<const NodeId> children);
+  void gen_expr(NodeId n, Env& env) const;
+  void gen_block(std::span<const NodeId> stmts, Env& env) const;
+  void gen_parallel(NodeId n, Env& env) const;
+  bool invertible(NodeId cond) const;
+  void gen_inverted(NodeId cond, Env& env) const;
+  bool gen_unrolled(NodeId n, Env& env) const;
+  std::vector<int> arm_order(NodeId n, const Env& env) const;
+
+  std::vector<NodeKind> kinds;
+  std::vector<int> values;
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> first;
+  std::vector<NodeId> child_ids;
+  std::vector<NodeId> canons;
+
+  // (kind, value, canon of each child) -> canon
+  std::unordered_map<std::array<int, 4>, NodeId, KeyHash> consed;
 };
 
 #endif //ZPC_AST_H
@@ -0,0 +1,45 @@
+#include "batch.h"
+#include "thread.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+void run_batch(const FusedProgram& program, size_t count, const std::function<std::string(size_t)>& input,
+               const BatchOptions& options, const std::function<void(size_t, BatchRun&)>& done) {
+  std::vector<BatchRun> runs(count);
+  std::vector<std::atomic<bool>> finished(count); // runs[i] is set
+  std::atomic<size_t> next{0};
+  auto work = [&] {
+    for (size_t i; (i = next++) < count;) {
+      BatchRun run;
+      std::ostringstream out;
+      try {
+        std::istringstream in{input(i)};
+        program.run(in, out, nullptr, options.max_steps);
+      } catch (const std::exception& e) {
+        run.error = e.what();
+      } catch (...) {
+        run.error = "Unknown exception.";
+      }
+      run.output = std::move(out).str();
+      runs[i] = std::move(run);
+      finished[i] = true;
+      finished[i].notify_one();
+    }
+  };
+  std::vector<std::unique_ptr<StackThread>> workers;
+  try {
+    for (int k = 0; k < std::max(options.jobs, 1); ++k) workers.push_back(std::make_unique<StackThread>(0, work));
+    for (size_t i = 0; i < count; ++i) {
+      finished[i].wait(false);
+      auto run = std::exchange(runs[i], {});
+      done(i, run);
+    }
+  } catch (...) {
+    next = count; // workers finish the run they are on and stop
+    throw;
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef ZPC_BATCH_H
+#define ZPC_BATCH_H
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include "vm.h"
+
+// What one run of a batch wrote, and why it stopped early, if it did.
+struct BatchRun {
+  std::string output;
+  std::string error; // empty when the program ran to its end
+};
+
+struct BatchOptions {
+  int jobs = 1;           // worker threads
+  uint64_t max_steps = 0; // P-code instructions per run, 0 for no limit
+};
+
+// Runs `program` once per input, on options.jobs threads: run i reads from
+// the text input(i) returns, which is called on the worker, and whatever it
+// throws becomes that run's error. Every run has its own stack and
+// variables. `done` gets each run on the calling thread, in input order, as
+// soon as it and every run before it have finished.
+void run_batch(const FusedProgram& program, size_t count, const std::function<std::string(size_t)>& input,
+               const BatchOptions& options, const std::function<void(size_t, BatchRun&)>& done);
+
+#endif //ZPC_BATCH_H
@@ -0,0 +1,333 @@
+#include <benchmark/benchmark.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include "compiler.hpp"
+#include "batch.h"
+#include "generator.hpp"
+#include "vm.h"
+
+// ========================= allocation tracking =========================
+
+namespace {
+  std::atomic<size_t> live_bytes{0}, peak_bytes{0}, allocated_bytes{0};
+
+  void reset_peak() { peak_bytes = live_bytes.load(); allocated_bytes = 0; }
+
+  long peak_rss_kb() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+  }
+
+  // Every replaceable operator new and delete below comes through these two.
+  void* allocate(size_t n, size_t align) {
+    void* p = nullptr;
+    if (align <= alignof(std::max_align_t)) p = malloc(n ? n : 1);
+    else if (posix_memalign(&p, align, n ? n : 1) != 0) p = nullptr;
+    if (!p) return nullptr;
+    size_t sz = malloc_usable_size(p);
+    allocated_bytes += sz;
+    size_t live = live_bytes += sz;
+    size_t peak = peak_bytes.load();
+    while (live > peak && !peak_bytes.compare_exchange_weak(peak, live));
+    return p;
+  }
+
+  void release(void* p) noexcept {
+    if (!p) return;
+    live_bytes -= malloc_usable_size(p);
+    free(p);
+  }
+
+  void* allocate_or_throw(size_t n, size_t align) {
+    void* p = allocate(n, align);
+    if (!p) throw std::bad_alloc();
+    return p;
+  }
+}
+
+void* operator new(size_t n) { return allocate_or_throw(n, 0); }
+void* operator new[](size_t n) { return allocate_or_throw(n, 0); }
+void* operator new(size_t n, std::align_val_t a) { return allocate_or_throw(n, size_t(a)); }
+void* operator new[](size_t n, std::align_val_t a) { return allocate_or_throw(n, size_t(a)); }
+void* operator new(size_t n, const std::nothrow_t&) noexcept { return allocate(n, 0); }
+void* operator new[](size_t n, const std::nothrow_t&) noexcept { return allocate(n, 0); }
+void* operator new(size_t n, std::align_val_t a, const std::nothrow_t&) noexcept { return allocate(n, size_t(a)); }
+void* operator new[](size_t n, std::align_val_t a, const std::nothrow_t&) noexcept { return allocate(n, size_t(a)); }
+
+void operator delete(void* p) noexcept { release(p); }
+void operator delete[](void* p) noexcept { release(p); }
+void operator delete(void* p, size_t) noexcept { release(p); }
+void operator delete[](void* p, size_t) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { release(p); }
+
+// ========================= workloads =========================
+
+enum Shape { kStraightLine, kDeepExpr, kNestedControl, kManyVars };
+
+GeneratedProgram make_program(Shape shape, int n) {
+  ProgramGenerator g(20201018);
+  switch (shape) {
+    case kStraightLine: return g.straight_line(n);
+    case kDeepExpr: return g.deep_expr(n);
+    case kNestedControl: return g.nested_control(n);
+    case kManyVars: return g.many_vars(n);
+  }
+  return {};
+}
+
+NodeId parse(const Grammar& grammar, Ast& ast, const std::string& source) {
+  global_input = source;
+  ast.clear();
+  Ast::current = &ast;
+  global_errors.clear(0);
+  auto scanner = Scanner(source);
+  auto res = grammar.program(scanner);
+  if (!res || !global_errors.empty()) throw std::runtime_error("bench program does not parse");
+  return res.value();
+}
+
+void report(benchmark::State& state, const GeneratedProgram& p, size_t peak) {
+  state.SetComplexityN(state.range(0));
+  state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(p.source.size()));
+  state.counters["stmts/s"] = benchmark::Counter(double(p.statements), benchmark::Counter::kIsIterationInvariantRate);
+  // Time per statement: stays flat while scaling is linear.
+  state.counters["s/stmt"] = benchmark::Counter(
+    double(p.statements), benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+  state.counters["alloc/iter"] = benchmark::Counter(
+    double(allocated_bytes.load()) / double(state.iterations()), benchmark::Counter::kDefaults,
+    benchmark::Counter::kIs1024);
+  state.counters["peak_heap"] = benchmark::Counter(double(peak), benchmark::Counter::kDefaults,
+                                                   benchmark::Counter::kIs1024);
+  state.counters["peak_rss"] = benchmark::Counter(double(peak_rss_kb()) * 1024, benchmark::Counter::kDefaults,
+                                                  benchmark::Counter::kIs1024);
+}
+
+void BM_Parse(benchmark::State& state, Shape shape) {
+  static auto grammar = build_parser();
+  auto p = make_program(shape, int(state.range(0)));
+  size_t base = live_bytes;
+  reset_peak();
+  Ast ast;
+  for (auto _ : state) benchmark::DoNotOptimize(parse(grammar, ast, p.source));
+  report(state, p, peak_bytes - base);
+}
+
+void BM_Codegen(benchmark::State& state, Shape shape) {
+  static auto grammar = build_parser();
+  auto p = make_program(shape, int(state.range(0)));
+  Ast ast;
+  auto root = parse(grammar, ast, p.source);
+  size_t base = live_bytes;
+  reset_peak();
+  for (auto _ : state) {
+    Env env;
+    ast.gen(root, env);
+    benchmark::DoNotOptimize(env.code.instructions().data());
+  }
+  report(state, p, peak_bytes - base);
+}
+
+// Same as BM_Codegen, with one thread per core for large sequences.
+void BM_CodegenParallel(benchmark::State& state, Shape shape) {
+  static auto grammar = build_parser();
+  auto p = make_program(shape, int(state.range(0)));
+  Ast ast;
+  auto root = parse(grammar, ast, p.source);
+  size_t base = live_bytes;
+  reset_peak();
+  for (auto _ : state) {
+    Env env;
+    env.jobs = int(std::max(1u, std::thread::hardware_concurrency()));
+    ast.gen(root, env);
+    benchmark::DoNotOptimize(env.code.instructions().data());
+  }
+  report(state, p, peak_bytes - base);
+}
+
+void BM_Compile(benchmark::State& state, Shape shape) {
+  auto p = make_program(shape, int(state.range(0)));
+  size_t base = live_bytes;
+  reset_peak();
+  for (auto _ : state) benchmark::DoNotOptimize(compile(p.source));
+  report(state, p, peak_bytes - base);
+}
+
+// Same as BM_Compile, but through compile_streaming(). Output below the 64 KiB
+// flush threshold stays buffered, so peak_heap grows with small programs; past
+// it (straight_line from 1024 statements) it stays flat. many_vars still grows
+// with its variables, which the symbol table keeps for the whole program.
+void BM_CompileStreaming(benchmark::State& state, Shape shape) {
+  auto p = make_program(shape, int(state.range(0)));
+  size_t base = live_bytes;
+  reset_peak();
+  for (auto _ : state) benchmark::DoNotOptimize(compile_streaming(p.source, "bench_stream.tmp"));
+  std::remove("bench_stream.tmp");
+  report(state, p, peak_bytes - base);
+}
+
+// Runs a program of the test corpus through FusedProgram. `insns` is the
+// number of P-code instructions a run executes, `dispatches` the number the
+// fused program dispatches for them.
+void BM_Execute(benchmark::State& state, const char* source) {
+  auto compiled = compile_program(source);
+  ExecutionProfile profile;
+  std::istringstream in;
+  std::ostringstream out;
+  execute(compiled.instructions, in, out, &profile);
+  FusedProgram program(compiled.instructions);
+  uint64_t dispatches = 0;
+  program.run(in, out, &dispatches);
+  for (auto _ : state) {
+    std::ostringstream sink;
+    program.run(in, sink);
+    benchmark::DoNotOptimize(sink.str().data());
+  }
+  state.counters["insns"] = double(profile.total_count());
+  state.counters["dispatches"] = double(dispatches);
+  state.counters["dispatch/insn"] = double(dispatches) / double(profile.total_count());
+  state.counters["insns/s"] = benchmark::Counter(double(profile.total_count()), benchmark::Counter::kIsIterationInvariantRate);
+}
+
+// A straight-line program with every tenth statement broken, compiled
+// without an error cap: reporting stays linear in the input however many
+// errors it has.
+void BM_Diagnostics(benchmark::State& state) {
+  auto p = make_program(kStraightLine, int(state.range(0)));
+  for (size_t at = 0, k = 0; (at = p.source.find(":=", at)) != std::string::npos; at += 2)
+    if (++k % 10 == 0) p.source[at + 1] = ' ';
+  size_t errors = 0;
+  for (auto _ : state) {
+    auto result = compile_program(p.source, {.max_errors = 0});
+    errors = result.diagnostics.errors.size();
+    benchmark::DoNotOptimize(result.diagnostics.errors.data());
+  }
+  report(state, p, 0);
+  state.counters["errors"] = double(errors);
+}
+
+BENCHMARK(BM_Diagnostics)->RangeMultiplier(4)->Range(64, 16384)->UseRealTime()->Complexity(benchmark::oN);
+
+// Programs of the test corpus, run by both engines.
+const char* gcd_program = R"(
+  s := 0;
+  for k := 1; k <= 2000; k := k + 1 do
+    x := k * 7; y := 192;
+    while y != 0 do t := y; y := x % y; x := t end;
+    s := s + x
+  end;
+  write s
+)";
+const char* prime_program = R"(
+  for i := 2; i <= 3000; i := i + 1 do
+    flag := 1;
+    for j := 2; j * j <= i; j := j + 1 do
+      if i % j == 0 then flag := 0; break end
+    end;
+    if flag == 1 then write i end
+  end
+)";
+const char* match_program = R"(
+  s := 0;
+  for i := 0; i < 20000; i := i + 1 do
+    match i % 4 of case 0 => s := s + 2 case 1 => s := s - 1 case 3 => s := s + i end
+  end;
+  write s
+)";
+const char* write_program = "for i := 0; i < 5000; i := i + 1 do write i end";
+const char* arith_program = R"(
+  s := 0; x := 1;
+  for i := 0; i < 20000; i := i + 1 do
+    x := (x * 75 + 74) % 65537; s := s + x * i - s / 3
+  end;
+  write s
+)";
+
+BENCHMARK_CAPTURE(BM_Execute, gcd, gcd_program);
+BENCHMARK_CAPTURE(BM_Execute, prime, prime_program);
+BENCHMARK_CAPTURE(BM_Execute, match, match_program);
+BENCHMARK_CAPTURE(BM_Execute, write, write_program);
+BENCHMARK_CAPTURE(BM_Execute, arith, arith_program);
+
+// The same programs through RegisterProgram. `dispatches` is the number of
+// register instructions a run executes, `vs_pcode` and `vs_fused` its ratio
+// to the P-code instructions and to FusedProgram's dispatches.
+void BM_Registers(benchmark::State& state, const char* source) {
+  auto compiled = compile_program(source, {.registers = true});
+  ExecutionProfile profile;
+  std::istringstream in;
+  std::ostringstream out;
+  execute(compiled.instructions, in, out, &profile);
+  uint64_t fused = 0, dispatches = 0;
+  FusedProgram(compiled.instructions).run(in, out, &fused);
+  auto& program = *compiled.registers;
+  program.run(in, out, &dispatches);
+  for (auto _ : state) {
+    std::ostringstream sink;
+    program.run(in, sink);
+    benchmark::DoNotOptimize(sink.str().data());
+  }
+  state.counters["dispatches"] = double(dispatches);
+  state.counters["vs_pcode"] = double(dispatches) / double(profile.total_count());
+  state.counters["vs_fused"] = double(dispatches) / double(fused);
+  state.counters["bytes"] = double(program.bytes());
+}
+
+BENCHMARK_CAPTURE(BM_Registers, gcd, gcd_program);
+BENCHMARK_CAPTURE(BM_Registers, prime, prime_program);
+BENCHMARK_CAPTURE(BM_Registers, match, match_program);
+BENCHMARK_CAPTURE(BM_Registers, write, write_program);
+BENCHMARK_CAPTURE(BM_Registers, arith, arith_program);
+
+// One program over 1024 input vectors on state.range(0) threads; runs/s
+// should grow with the thread count up to the number of cores.
+void BM_Batch(benchmark::State& state) {
+  auto compiled = compile_program(R"(
+    read x; read y;
+    while y != 0 do t := y; y := x % y; x := t end;
+    s := 0;
+    for i := 0; i < x % 500; i := i + 1 do s := s + i * i end;
+    write x; write s
+  )");
+  FusedProgram program(compiled.instructions);
+  std::vector<std::string> inputs;
+  std::mt19937 rng(20201018);
+  for (int i = 0; i < 1024; ++i) inputs.push_back(fmt::format("{} {}", rng() % 100000, rng() % 100000));
+  for (auto _ : state) {
+    size_t bytes = 0;
+    run_batch(program, inputs.size(), [&](size_t i) { return inputs[i]; }, {.jobs = int(state.range(0))},
+              [&](size_t, BatchRun& run) { bytes += run.output.size(); });
+    benchmark::DoNotOptimize(bytes);
+  }
+  state.counters["runs/s"] = benchmark::Counter(double(inputs.size()), benchmark::Counter::kIsIterationInvariantRate);
+}
+
+BENCHMARK(BM_Batch)->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+
+#define ZPC_BENCH_SHAPES(bm)                                                                  \
+  BENCHMARK_CAPTURE(bm, straight_line, kStraightLine)->RangeMultiplier(4)->Range(16, 4096)   \
+    ->Complexity();                                                                           \
+  BENCHMARK_CAPTURE(bm, deep_expr, kDeepExpr)->RangeMultiplier(2)->Range(4, 256)->Complexity(); \
+  BENCHMARK_CAPTURE(bm, nested_control, kNestedControl)->RangeMultiplier(2)->Range(4, 32)     \
+    ->Complexity();                                                                           \
+  BENCHMARK_CAPTURE(bm, many_vars, kManyVars)->RangeMultiplier(4)->Range(16, 4096)->Complexity();
+
+ZPC_BENCH_SHAPES(BM_Parse)
+ZPC_BENCH_SHAPES(BM_Codegen)
+ZPC_BENCH_SHAPES(BM_CodegenParallel)
+ZPC_BENCH_SHAPES(BM_Compile)
+ZPC_BENCH_SHAPES(BM_CompileStreaming)
+
+BENCHMARK_MAIN();
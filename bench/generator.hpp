@@ -0,0 +1,106 @@
+#ifndef ZPC_BENCH_GENERATOR_HPP
+#define ZPC_BENCH_GENERATOR_HPP
+
+#include <fmt/format.h>
+#include <random>
+#include <string>
+#include <vector>
+
+// Seeded generator of synthetic programs. Every program it produces is
+// well-formed and only reads variables after they have been assigned, so it
+// can be fed through both the parser and the code generator.
+struct GeneratedProgram {
+  std::string source;
+  size_t statements = 0;
+};
+
+class ProgramGenerator {
+public:
+  explicit ProgramGenerator(unsigned seed = 42) : rng(seed) {}
+
+  // n statements in one flat sequence over a small pool of variables.
+  GeneratedProgram straight_line(int n) {
+    GeneratedProgram p;
+    for (int i = 0; i < 8 && i < n; ++i) add(p, fmt::format("v{} := {}", i, i));
+    for (int i = 8; i < n; ++i) {
+      switch (pick(4)) {
+        case 0: add(p, fmt::format("write {}", expr(3, 8))); break;
+        case 1: add(p, fmt::format("if {} then v{} := {} end", cond(8), pick(8), expr(2, 8))); break;
+        default: add(p, fmt::format("v{} := {}", pick(8), expr(3, 8))); break;
+      }
+    }
+    return p;
+  }
+
+  // One expression nested `depth` parentheses deep.
+  GeneratedProgram deep_expr(int depth) {
+    GeneratedProgram p;
+    std::string e = "1";
+    for (int i = 0; i < depth; ++i) {
+      static const char* ops[] = {"+", "-", "*", "/", "%"};
+      e = fmt::format("({} {} {})", e, ops[pick(5)], 1 + pick(9));
+    }
+    add(p, "write " + e);
+    return p;
+  }
+
+  // `depth` levels of if/for/match nested inside each other.
+  GeneratedProgram nested_control(int depth) {
+    GeneratedProgram p;
+    std::string body = "write i0";
+    for (int i = depth - 1; i >= 0; --i) {
+      switch (i % 3) {
+        case 0:
+          body = fmt::format("for i{0} := 0; i{0} < 2; i{0} := i{0} + 1 do {1} end", i, body);
+          break;
+        case 1:
+          body = fmt::format("if i0 < {} then {} else write {} end", pick(9), body, i);
+          break;
+        default:
+          body = fmt::format("match i0 of case 0 => {} case 1 => write {} end", body, i);
+          break;
+      }
+    }
+    add(p, "i0 := 0");
+    add(p, body);
+    p.statements += depth;
+    return p;
+  }
+
+  // n distinct variables, each assigned once and then read back.
+  GeneratedProgram many_vars(int n) {
+    GeneratedProgram p;
+    for (int i = 0; i < n; ++i) add(p, fmt::format("var{} := {}", i, i));
+    for (int i = 0; i < n; ++i) add(p, fmt::format("write var{} + var{}", i, pick(n)));
+    return p;
+  }
+
+private:
+  int pick(int n) { return std::uniform_int_distribution<int>(0, n - 1)(rng); }
+
+  std::string atom(int vars) {
+    if (pick(2)) return std::to_string(pick(100));
+    return fmt::format("v{}", pick(vars));
+  }
+
+  std::string expr(int depth, int vars) {
+    if (depth == 0 || pick(3) == 0) return atom(vars);
+    static const char* ops[] = {"+", "-", "*"};
+    return fmt::format("({} {} {})", expr(depth - 1, vars), ops[pick(3)], expr(depth - 1, vars));
+  }
+
+  std::string cond(int vars) {
+    static const char* ops[] = {"<", ">", "<=", ">=", "==", "!="};
+    return fmt::format("{} {} {}", expr(1, vars), ops[pick(6)], expr(1, vars));
+  }
+
+  static void add(GeneratedProgram& p, const std::string& stmt) {
+    if (!p.source.empty()) p.source += ";\n";
+    p.source += stmt;
+    p.statements += 1;
+  }
+
+  std::mt19937 rng;
+};
+
+#endif //ZPC_BENCH_GENERATOR_HPP
@@ -5,49 +5,121 @@
 #include "zpc/scanner.hpp"
 #include "zpc/printer.hpp"
 #include <fmt/format.h>
+#include <sys/resource.h>
 #include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <functional>
+#include <limits>
 #include <numeric>
 #include <utility>
 #include <map>
+#include <memory>
+#include <optional>
 #include <stack>
 #include <set>
 
 #include "ast.h"
+#include "env.h"
+#include "io.h"
+#include "regvm.h"
+#include "thread.h"
+#include "vm.h"
 
-std::ostream& operator << (std::ostream& os, const Node* n) {
-  return os << n->to_string();
-}
-
-std::set<int> global_error_position;
-std::string global_input;
-void output_error_position(int furthest) {
-  const auto& s = global_input;
-  furthest = s.size() - furthest;
-  std::string_view in_view = s;
-  int line_cnt = 0;
-  while (!in_view.empty()) {
-    ++line_cnt;
-    size_t pos = in_view.find_first_of('\n');
-    if (pos < furthest) {
-      in_view.remove_prefix(pos + 1);
-      furthest -= pos + 1;
-    } else {
-      std::cerr << fmt::format("Compiler Error at Line {}", line_cnt) << std::endl;
-      std::cerr << in_view.substr(0, pos) << std::endl;
-      std::cerr << std::string(furthest, ' ') << '^' << std::endl;
-      break;
+std::string_view global_input;
+
+// A syntax error, an integer literal out of range, or statements nested
+// past the depth limit, located in the source.
+struct Diagnostic {
+  size_t offset;
+  int line, column; // counting from 1
+  std::string message;
+};
+
+struct Diagnostics {
+  std::vector<Diagnostic> errors; // in source order
+  bool truncated = false;         // parsing stopped at an error past the cap; there may be more
+  explicit operator bool () const { return !errors.empty(); }
+};
+
+// Thrown out of the parser when it cannot go on: at the error cap, or at
+// statements nested past the depth limit.
+struct ErrorLimit {};
+
+// Syntax errors of a compile that has no result to return them in.
+struct CompileError: std::runtime_error {
+  explicit CompileError(Diagnostics diagnostics)
+    : std::runtime_error("Compile Error"), diagnostics(std::move(diagnostics)) {}
+  Diagnostics diagnostics;
+};
+
+// Where parsing of global_input got stuck, as recovery points are recorded.
+// The parser only moves forward, so the points come in source order.
+struct ErrorLog {
+  std::vector<size_t> offsets;
+  std::vector<std::string> messages; // by error; empty for the word found at the offset
+  int max_errors = 3; // 0 for no cap
+  bool truncated = false;
+
+  // `remaining` is Scanner::furthest: bytes left after the furthest point
+  // parsed. Throws ErrorLimit for an error past the cap.
+  void add(size_t remaining, std::string message = {}) {
+    size_t at = global_input.size() - remaining;
+    if (!offsets.empty() && offsets.back() >= at) return;
+    if (max_errors > 0 && offsets.size() >= size_t(max_errors)) {
+      truncated = true;
+      throw ErrorLimit{};
     }
+    offsets.push_back(at);
+    messages.push_back(std::move(message));
+  }
+  bool empty() const { return offsets.empty(); }
+  void clear(int cap) {
+    offsets.clear();
+    messages.clear();
+    max_errors = cap;
+    truncated = false;
   }
-}
 
+  // Locates every point with one index of line starts.
+  Diagnostics diagnostics() const {
+    Diagnostics d;
+    d.truncated = truncated;
+    LineIndex lines(global_input);
+    for (size_t k = 0; k < offsets.size(); ++k) {
+      size_t at = offsets[k];
+      auto rest = global_input.substr(at);
+      auto end = std::find_if(rest.begin(), rest.end(), [](unsigned char c) { return !isalnum(c); });
+      auto word = rest.substr(0, std::max<size_t>(end - rest.begin(), 1)); // a word or one character
+      d.errors.push_back({at, lines.line(at), lines.column(at),
+                          !messages[k].empty() ? messages[k]
+                          : word.empty() ? "Unexpected end of input." : fmt::format("Unexpected \"{}\".", word)});
+    }
+    return d;
+  }
+};
+ErrorLog global_errors;
 
-Parser<Expr*> build_binary_parser(const Parser<Expr*>& p, const Parser<std::string>& op) {
-  return seq(p, many(seq(op, p))) %= [](Expr* e, const std::vector<std::tuple<std::string, Expr*>>& rest) {
-    return std::accumulate(rest.begin(), rest.end(), e, [](Expr* e, const std::tuple<std::string, Expr*>& t)->Expr* {
-      return new BinaryOp(e, std::get<std::string>(t), std::get<Expr*>(t));
-    });
-  };
+// Each error of `source` as its line and message, the source line and a
+// caret under the column.
+void write_diagnostics(std::ostream& os, std::string_view source, const Diagnostics& d) {
+  LineIndex lines(source);
+  for (auto& e: d.errors) {
+    os << fmt::format("Compiler Error at Line {}: {}\n", e.line, e.message);
+    os << lines.text(e.line) << '\n' << std::string(e.column - 1, ' ') << "^\n";
+  }
+  if (d.truncated) os << fmt::format("Stopped after {} errors.\n", d.errors.size());
+  os.flush();
+}
+
+// Where a statement that fails at `in` goes wrong, as Scanner::furthest:
+// at a stray `end` the statement would start with, else the furthest point
+// parsed.
+size_t error_point(const Scanner& in) {
+  Scanner at = in;
+  skip_space(at);
+  if (at.starts_with("end") && (at.size() == 3 || !isalnum((unsigned char)at[3]))) return at.size();
+  return in.furthest;
 }
 
 template<typename T, typename E>
@@ -55,142 +127,692 @@ Parser<T> fallback(const Parser<T>& p, const T& v, const Parser<E>& e) {
   return [=](Scanner& in)->ParseResult<T> {
     auto res = p(in);
     if (res) return res;
-    global_error_position.insert(in.furthest);
+    global_errors.add(error_point(in));
     if (!e(in)) return {};
     return v;
   };
 }
 
-std::set<std::string> kw_set;
+// Skips the rest of a statement that does not parse, up to the next `;` or
+// `end` outside comments, in one scan of the text.
+Parser<size_t> skip_to_sync() {
+  return [](Scanner& in)->ParseResult<size_t> {
+    std::string_view s = in.substr(0);
+    size_t at = 0;
+    while ((at = s.find_first_of(";e/", at)) != s.npos) {
+      if (s[at] == ';') break;
+      if (s[at] == '/') {
+        if (s.substr(at).starts_with("/*")) at = std::min(s.find("*/", at + 2), s.size() - 2) + 2;
+        else if (s.substr(at).starts_with("//")) at = std::min(s.find('\n', at), s.size());
+        else ++at;
+        continue;
+      }
+      if ((at == 0 || !isalnum((unsigned char)s[at - 1])) && s.substr(at, 3) == "end" &&
+          (at + 3 == s.size() || !isalnum((unsigned char)s[at + 3])))
+        break;
+      ++at;
+    }
+    at = std::min(at, s.size());
+    in.remove_prefix(at);
+    return at;
+  };
+}
+
+// After a statement sequence stops short of where it should end: records
+// the error, then skips past the next `;` or `end`, and a `;` right after
+// that `end`, so that parsing can go on and report later errors too.
+void resync(Scanner& in) {
+  global_errors.add(error_point(in));
+  skip_to_sync()(in);
+  if (in.starts_with(";")) {
+    in.remove_prefix(1);
+  } else if (in.starts_with("end")) {
+    in.remove_prefix(3);
+    skip_space(in);
+    if (in.starts_with(";")) in.remove_prefix(1);
+  }
+}
+
+// Records where in global_input the node built by `p` starts.
+Parser<NodeId> located(const Parser<NodeId>& p) {
+  return [=](Scanner& in)->ParseResult<NodeId> {
+    if (in.skip) skip_space(in);
+    auto at = static_cast<uint32_t>(global_input.size() - in.size());
+    auto res = p(in);
+    if (res) Ast::current->locate(res.value(), at);
+    return res;
+  };
+}
+
+int global_max_depth = 100000; // statement nesting allowed in global_input
+int global_stack_levels = std::numeric_limits<int>::max(); // statement nesting the parsing stack has room for
+int global_depth = 0;
+
+// Thrown out of the parser at statements nested deeper than
+// global_stack_levels, for run_nested() to rerun the work on a bigger stack.
+struct StackLimit {};
+
+// Counts the statement nesting around `p`. Once it goes past
+// global_max_depth, records a diagnostic at the statement and stops parsing.
+Parser<NodeId> depth_limited(const Parser<NodeId>& p) {
+  return [=](Scanner& in)->ParseResult<NodeId> {
+    if (global_depth >= global_max_depth) {
+      Scanner at = in;
+      skip_space(at);
+      global_errors.add(at.size(), fmt::format("Statements nested deeper than {} levels.", global_max_depth));
+      throw ErrorLimit{};
+    }
+    if (global_depth >= global_stack_levels) throw StackLimit{};
+    ++global_depth;
+    struct Leave { ~Leave() { --global_depth; } } leave;
+    return p(in);
+  };
+}
 
-auto build_parser() {
-  auto anychar = ch([](char){ return true; });
+std::set<std::string, std::less<>> kw_set;
+
+struct Grammar {
+  Parser<NodeId> program;         // a whole source file
+  Parser<NodeId> statement;       // one statement of a sequence, recording errors instead of failing
+  Parser<std::string> separator; // between statements of a sequence
+};
+
+// The parser builds its nodes into Ast::current.
+Grammar build_parser() {
   auto letter = alt(ch_range('a', 'z'), ch_range('A', 'Z'));
   auto digit = ch_range('0', '9');
 
   auto kw = [&](const std::string& s) {
-    kw_set.insert(s);
-    return seq(lit(s), not_predicate(alt(digit, letter))).atom() % RESOLVE_OVERLOAD(std::get<0>);
+    auto name = kw_set.insert(s).first->c_str();
+    return (seq(lit(s), not_predicate(alt(digit, letter))).atom() % RESOLVE_OVERLOAD(std::get<0>)).named(name);
   };
 
-  Parser<Expr*> identifier = raw(seq(letter, many(alt(digit, letter)))).atom()
-    % [](auto&& s){ return new Identifier(s); }
-    /= [](Identifier* id){ return !kw_set.contains(id->name); };
-  Parser<Expr*> number = raw(many1(digit)).atom() % [](auto&& s){ return new Num(std::stoi(s)); };
-
-  static Parser<Expr*> expr;
-  Parser<Expr*> factor = alt(number, identifier,
-                             seq(lit("("), lazy(expr), lit(")")) % RESOLVE_OVERLOAD(std::get<1>));
-  Parser<Expr*> unary_expr = seq(
-    many(alt(kw("odd"), kw("not"), lit("++"), lit("--"))),
-    factor
-  ) %= [](const std::vector<std::string>& v, Expr* e) {
-    return std::accumulate(v.rbegin(), v.rend(), e, [](Expr* e, const std::string& op)->Expr* {
-      return new UnaryOp(op, e);
-    });
+  Parser<NodeId> identifier = located((raw(seq(letter, many(alt(digit, letter)))).atom()
+    /= [](std::string_view s){ return !kw_set.contains(s); })
+    % [](auto&& s) { return Ast::current->identifier(global_symbols.intern(s)); }).named("identifier");
+  Parser<NodeId> number = located(raw(many1(digit)).atom() % [](std::string_view s) {
+    int v = 0;
+    if (std::from_chars(s.data(), s.data() + s.size(), v).ec != std::errc{})
+      global_errors.add(global_input.size() - size_t(s.data() - global_input.data()),
+                        fmt::format("Integer literal {} is out of range.", s));
+    return Ast::current->num(v);
+  }).named("number");
+
+  Parser<NodeId> factor = alt(number, identifier).named("factor");
+  static const OperatorTable<UnOp, BinOp> operators = {
+    .prefix = {{"odd", UnOp::odd}, {"not", UnOp::not_}, {"++", UnOp::inc}, {"--", UnOp::dec}},
+    .infix = {
+      {"*", BinOp::mul, 5}, {"/", BinOp::div, 5}, {"%", BinOp::mod, 5},
+      {"+", BinOp::add, 4}, {"-", BinOp::sub, 4},
+      {"<=", BinOp::leq, 3}, {">=", BinOp::geq, 3}, {"==", BinOp::equ, 3},
+      {">", BinOp::grt, 3}, {"<", BinOp::les, 3}, {"!=", BinOp::neq, 3},
+      {"and", BinOp::and_, 2},
+      {"or", BinOp::or_, 1}, {"xor", BinOp::xor_, 1},
+    },
+    .group = {"(", ")"},
   };
-  Parser<Expr*> expr_1 = build_binary_parser(unary_expr,
-    alt(lit("*"), lit("/"), lit("%") % [](auto&&){ return std::string("mod"); }));
-  Parser<Expr*> expr_2 = build_binary_parser(expr_1, alt(lit("+"), lit("-")));
-  Parser<Expr*> expr_3 = build_binary_parser(expr_2, alt(lit("<="), lit(">="), lit("=="), lit(">"), lit("<"), lit("!=")));
-  Parser<Expr*> expr_4 = build_binary_parser(expr_3, lit("and"));
-  Parser<Expr*> expr_5 = build_binary_parser(expr_4, alt(lit("or"), lit("xor")));
-  expr = expr_5;
-
-  static Parser<Stmt*> statement;
+  kw_set.insert({"odd", "not"}); // prefix operators are reserved words
+  // Parenthesised groups are part of the operator table, so expressions
+  // of any nesting depth parse without recursion.
+  Parser<NodeId> expr = precedence(factor, operators,
+    [](UnOp op, NodeId e) { return Ast::current->unary(op, e); },
+    [](NodeId l, BinOp op, NodeId r) { return Ast::current->binary(l, op, r); }
+  ).named("expr");
+
+  static Parser<NodeId> statement;
   auto lazy_stmt = lazy(statement);
-  Parser<Stmt*> stmt_sequence = sep_by(
-    fallback(lazy_stmt,
-             static_cast<Stmt*>(empty_stmt),
-             many(seq(not_predicate(lit(";")), anychar))),
-    lit(";")
-  ) % [](auto&& stmts){ return new StmtSequence(stmts); };
-  Parser<Stmt*> read_stmt = seq(kw("read"), identifier) %= [](auto&&, auto&& id){ return new ReadStmt(id); };
-  Parser<Stmt*> write_stmt = seq(kw("write"), expr) %= [](auto&&, auto&& e){ return new WriteStmt(e); };
-  Parser<Stmt*> assign_stmt = seq(identifier, lit(":="), expr) %= [](auto&& id, auto&&, auto&& e){ return new AssignStmt(id, e); };
-  Parser<Stmt*> if_stmt = seq(
+  Parser<NodeId> recovering_stmt = fallback(lazy_stmt, empty_stmt, skip_to_sync());
+  Parser<std::string> separator = lit(";");
+  Parser<NodeId> stmt_sequence = (sep_by(recovering_stmt, separator)
+    % [](auto&& stmts) { return Ast::current->sequence(stmts); }).named("stmt_sequence");
+  Parser<NodeId> read_stmt = (seq(kw("read"), identifier) %= [](auto&&, auto&& id) { return Ast::current->read(id); })
+    .named("read_stmt");
+  Parser<NodeId> write_stmt = (seq(kw("write"), expr) %= [](auto&&, auto&& e) { return Ast::current->write(e); })
+    .named("write_stmt");
+  Parser<NodeId> assign_stmt = (seq(identifier, lit(":="), expr) %= [](auto&& id, auto&&, auto&& e) { return Ast::current->assign(id, e); })
+    .named("assign_stmt");
+  Parser<NodeId> if_stmt = (seq(
     kw("if"),
     expr,
     kw("then"), stmt_sequence,
-    opt(seq(kw("else"), stmt_sequence)) % [](const optional<std::tuple<std::string, Stmt*>>& x)->Stmt* {
+    opt(seq(kw("else"), stmt_sequence)) % [](const optional<std::tuple<std::string, NodeId>>& x) {
       if (x.has_value()) return std::get<1>(x.value());
       else return empty_stmt;
     },
     kw("end")
-  ) %= [](auto&&, auto&& e, auto&&, auto&& s1, auto&& s2, auto&&){
-    return new IfStmt(e, s1, s2);
-  };
+  ) %= [](auto&&, auto&& e, auto&&, auto&& s1, auto&& s2, auto&&) {
+    return Ast::current->if_(e, s1, s2);
+  }).named("if_stmt");
 
-  Parser<Stmt*> for_stmt = seq(
+  Parser<NodeId> for_stmt = (seq(
     kw("for"),
     lazy_stmt, lit(";"), expr, lit(";"), lazy_stmt, kw("do"),
     stmt_sequence, kw("end")
   ) %= [](auto&&, auto&& s1, auto&&, auto&& s2, auto&&, auto&& s3, auto&&, auto&& s4, auto&&) {
-    return new ForStmt(s1, s2, s3, s4);
-  };
+    return Ast::current->for_(s1, s2, s3, s4);
+  }).named("for_stmt");
 
-  Parser<Stmt*> do_while = seq(kw("do"), stmt_sequence, kw("while"), expr) %=
+  Parser<NodeId> do_while = (seq(kw("do"), stmt_sequence, kw("while"), expr) %=
     [](auto&&, auto&& s, auto&&, auto&& e) {
-      return new ForStmt(s, e, empty_stmt, s);
-    };
+      return Ast::current->for_(s, e, empty_stmt, s);
+    }).named("do_while");
 
-  Parser<Stmt*> repeat_until = seq(kw("repeat"), stmt_sequence, kw("until"), expr) %=
+  Parser<NodeId> repeat_until = (seq(kw("repeat"), stmt_sequence, kw("until"), expr) %=
     [](auto&&, auto&& s, auto&&, auto&& e) {
-     return new ForStmt(s, new UnaryOp("not", e), empty_stmt, s);
-    };
+     return Ast::current->for_(s, Ast::current->unary(UnOp::not_, e), empty_stmt, s);
+    }).named("repeat_until");
 
-  Parser<Stmt*> while_do = seq(kw("while"), expr, kw("do"), stmt_sequence, kw("end")) %=
+  Parser<NodeId> while_do = (seq(kw("while"), expr, kw("do"), stmt_sequence, kw("end")) %=
      [](auto&&, auto&& e, auto&&, auto&& s, auto&&) {
-       return new ForStmt(empty_stmt, e, empty_stmt, s);
-     };
+       return Ast::current->for_(empty_stmt, e, empty_stmt, s);
+     }).named("while_do");
 
-  Parser<Stmt*> control_stmt = alt(
-    kw("break") % [](auto&&)->Stmt* { return new BreakStmt; },
-    kw("exit") % [](auto&&)->Stmt* { return new ExitStmt; },
-    kw("continue") % [](auto&&)->Stmt* { return new ContinueStmt; }
-  );
+  Parser<NodeId> control_stmt = alt(
+    kw("break") % [](auto&&) { return Ast::current->break_(); },
+    kw("exit") % [](auto&&) { return Ast::current->exit(); },
+    kw("continue") % [](auto&&) { return Ast::current->continue_(); }
+  ).named("control_stmt");
 
-  Parser<Stmt*> case_stmt = seq(
+  Parser<NodeId> case_stmt = (seq(
     kw("match"), expr, kw("of"),
     many(
       seq(kw("case"), expr, lit("=>"), stmt_sequence)
       %= [](auto&&, auto&& e, auto&&, auto&& s){ return std::make_pair(e, s); }),
     kw("end")
   ) %= [](auto&&, auto&& e, auto&&, auto&& v, auto&&) {
-    return new CaseStmt(e, v);
-  };
+    return Ast::current->case_(e, v);
+  }).named("case_stmt");
 
-  statement = alt(
+  statement = depth_limited(located(alt(
     read_stmt, write_stmt, assign_stmt,
     if_stmt, for_stmt, repeat_until, do_while, while_do, control_stmt, case_stmt
-  );
+  ))).named("statement");
 
-  Parser<Stmt*> program = seq(stmt_sequence, eof) % RESOLVE_OVERLOAD(std::get<0>);
+  auto statements = sep_by(recovering_stmt, separator).named("stmt_sequence");
+  Parser<NodeId> program = Parser<NodeId>([=](Scanner& in)->ParseResult<NodeId> {
+    std::vector<NodeId> stmts;
+    while (true) {
+      auto part = statements(in);
+      stmts.insert(stmts.end(), part.value().begin(), part.value().end());
+      if (eof(in)) return Ast::current->sequence(stmts);
+      resync(in);
+    }
+  }).named("program");
 
-  return program;
+  return Grammar{program, recovering_stmt, separator};
 }
 
 
-std::string compile(const std::string& in) {
-  global_input = in;
-  global_error_position.clear();
-  static auto parser = build_parser();
-  auto scanner = Scanner(in);
-  auto res = parser(scanner);
-  if (!res) global_error_position.insert(scanner.furthest);
-  if (!global_error_position.empty()) {
-    int cnt = 0;
-    for (auto pos: global_error_position | std::views::reverse) {
-      if (cnt++ == 3) break;
-      output_error_position(pos);
+struct CompileOptions {
+  bool dump_ast = false; // echo the AST to std::cout before codegen
+  GrammarProfiler* grammar_profiler = nullptr; // per-rule parser counters, if set
+  int jobs = 1; // codegen threads for large statement sequences
+  const std::vector<uint64_t>* profile = nullptr; // statement entry counts by node id, see read_counts()
+  int max_depth = 100000; // statement nesting limit; expressions nest without one
+  int unroll = 4; // body copies per iteration of counted for loops, 1 to disable
+  int max_errors = 3; // syntax errors before parsing stops, 0 for no cap
+  bool registers = false; // also lower the program to register bytecode
+};
+
+struct CompileStats {
+  double parse_ms = 0, codegen_ms = 0, emit_ms = 0;
+  std::map<std::string, int> node_counts;
+  size_t bytes_emitted = 0, instructions_emitted = 0;
+  int variable_slots = 0, labels_generated = 0;
+  long peak_memory_kb = 0;
+};
+
+struct CompileResult {
+  std::string code;
+  CompileStats stats;
+  std::vector<Insn> instructions; // the same code, by address
+  std::vector<int> locations;     // source offset of every instruction, -1 for none
+  std::vector<std::pair<int, int>> entries; // (statement node id, address its code starts at)
+  std::optional<RegisterProgram> registers; // with CompileOptions::registers
+  Diagnostics diagnostics; // syntax errors; when there are any, nothing else is set
+};
+
+std::ostream& operator << (std::ostream& os, const CompileStats& s) {
+  os << fmt::format("parse:   {:10.3f} ms\n", s.parse_ms);
+  os << fmt::format("codegen: {:10.3f} ms\n", s.codegen_ms);
+  os << fmt::format("emit:    {:10.3f} ms\n", s.emit_ms);
+  os << fmt::format("emitted: {} bytes, {} instructions\n", s.bytes_emitted, s.instructions_emitted);
+  os << fmt::format("slots:   {}\nlabels:  {}\n", s.variable_slots, s.labels_generated);
+  os << fmt::format("peak memory: {} KiB\n", s.peak_memory_kb);
+  os << "ast nodes:\n";
+  for (auto& [kind, cnt]: s.node_counts) os << fmt::format("  {:<14}{}\n", kind, cnt);
+  return os;
+}
+
+std::map<std::string, int> count_nodes(const Ast& ast, NodeId root) {
+  std::map<std::string, int> counts;
+  std::vector<NodeId> st{root};
+  while (!st.empty()) {
+    auto n = st.back();
+    st.pop_back();
+    ++counts[kind_name(ast.kind(n))];
+    for (auto c: ast.children(n)) st.push_back(c);
+  }
+  return counts;
+}
+
+const Grammar& default_grammar() {
+  static auto grammar = build_parser();
+  return grammar;
+}
+
+// Installs the per-compilation globals for the lifetime of one compile.
+struct CompileScope {
+  CompileScope(std::string_view in, Ast& ast, const CompileOptions& options) {
+    global_input = in;
+    global_errors.clear(options.max_errors);
+    global_symbols.clear();
+    Ast::current = &ast;
+    grammar_profiler = options.grammar_profiler;
+    global_max_depth = options.max_depth;
+    global_depth = 0;
+  }
+  ~CompileScope() {
+    Ast::current = nullptr;
+    grammar_profiler = nullptr;
+  }
+};
+
+// Parsing and lowering recurse once per level of statement nesting. A level
+// takes, unoptimised, up to about 5 KiB of stack (match arms);
+// stack_per_level leaves room for that. inline_levels fit in any thread's
+// default stack.
+constexpr size_t stack_per_level = 16 << 10;
+constexpr int inline_levels = (1 << 20) / stack_per_level;
+
+// Runs `f`, which parses and lowers, in place with room for inline_levels
+// of statement nesting. Whenever it nests deeper than that, `rewind` undoes
+// its partial work and it runs again on a thread with 8 times the levels,
+// up to one past `max_depth`, where the depth limit stops it instead. The
+// stack thus follows the nesting the input has rather than its length.
+// `f` gets the size of the stack it runs on, 0 for the calling thread's.
+void run_nested(int max_depth, const std::function<void()>& rewind, const std::function<void(size_t)>& f) {
+  size_t limit = size_t(std::max(max_depth, 0)) + 1;
+  for (size_t levels = std::min<size_t>(inline_levels, limit);; levels = std::min(levels * 8, limit)) {
+    size_t bytes = levels <= size_t(inline_levels) ? 0 : levels * stack_per_level + (1 << 20);
+    int saved = std::exchange(global_stack_levels, int(std::min<size_t>(levels, std::numeric_limits<int>::max())));
+    struct Restore { int& levels; int saved; ~Restore() { levels = saved; } } restore{global_stack_levels, saved};
+    try {
+      return run_with_stack(bytes, [&] { f(bytes); });
+    } catch (const StackLimit&) {
+      if (levels == limit) throw;
+      rewind();
     }
-    throw std::runtime_error("Compile Error");
-  } else {
-    std::cout << "Ast:\n" << res.value() << std::endl;
+  }
+}
+
+// Throws the syntax errors recorded so far as a CompileError, if any.
+void throw_diagnostics() {
+  if (!global_errors.empty()) throw CompileError(global_errors.diagnostics());
+}
+
+long peak_memory_kb() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+using stats_clock = std::chrono::steady_clock;
+
+double ms_since(stats_clock::time_point t) {
+  return std::chrono::duration<double, std::milli>(stats_clock::now() - t).count();
+}
+
+CompileResult compile_program(std::string_view in, const CompileOptions& options = {}) {
+  CompileResult result;
+  run_nested(options.max_depth, [&] { result = {}; }, [&](size_t stack_bytes) {
+    auto& stats = result.stats;
+
+    Ast ast;
+    CompileScope scope(in, ast, options);
+    auto& grammar = default_grammar();
+    auto t = stats_clock::now();
+    auto scanner = Scanner(in);
+    ParseResult<NodeId> res;
+    try {
+      res = grammar.program(scanner);
+      if (!res) global_errors.add(scanner.furthest);
+    } catch (const ErrorLimit&) {}
+    stats.parse_ms = ms_since(t);
+    if (!global_errors.empty()) {
+      result.diagnostics = global_errors.diagnostics();
+      return;
+    }
+
+    if (options.dump_ast) std::cout << "Ast:\n" << ast.to_string(res.value()) << std::endl;
+    stats.node_counts = count_nodes(ast, res.value());
+
+    t = stats_clock::now();
     Env env;
-    auto body = res.value()->gen(env);
-    return fmt::format("ssp {}\n", env.get_allocated()) + body + "hlt\n";
+    env.jobs = options.jobs;
+    env.unroll = options.unroll;
+    env.stack_bytes = stack_bytes;
+    env.counts = options.profile;
+    int ssp = env.code.emit(Op::ssp);
+    ast.gen(res.value(), env);
+    env.code.emit(Op::hlt);
+    env.code.patch(ssp, env.get_allocated());
+    stats.codegen_ms = ms_since(t);
+
+    t = stats_clock::now();
+    env.code.render(result.code);
+    stats.emit_ms = ms_since(t);
+    result.instructions = env.code.instructions();
+    for (int origin: env.code.origins()) result.locations.push_back(origin < 0 ? -1 : int(ast.offset(origin)));
+    result.entries = env.code.entries();
+
+    stats.bytes_emitted = result.code.size();
+    stats.instructions_emitted = env.code.size();
+    stats.variable_slots = env.get_allocated();
+    stats.labels_generated = env.code.label_count();
+    if (options.registers) result.registers.emplace(ast, res.value());
+    stats.peak_memory_kb = peak_memory_kb();
+  });
+  return result;
+}
+
+// Compiles `in` into the file `out_path` one top-level statement at a time:
+// each statement is parsed, lowered, flushed to the output and freed before
+// the next is read, so memory does not grow with program length. The frame
+// size is patched into a fixed-width ssp header at the end. Parsing goes on
+// after the first error to report diagnostics, but nothing more is lowered
+// and the output file is removed.
+CompileStats compile_streaming(std::string_view in, const std::string& out_path, const CompileOptions& options = {}) {
+  static constexpr size_t flush_threshold = 64 << 10;
+  static constexpr std::string_view header = "ssp 0000000000\n";
+  CompileStats stats;
+  OutputFile out{out_path};
+  try {
+    Ast ast;
+    CompileScope scope(in, ast, options);
+    auto& grammar = default_grammar();
+    auto scanner = Scanner(in);
+    Env env;
+    env.jobs = options.jobs;
+    env.unroll = options.unroll;
+    std::string buf{header};
+    env.code.reserve(1);
+    try {
+      while (true) {
+        // Only a statement nested too deep for this thread moves to a bigger stack.
+        auto start = scanner;
+        run_nested(options.max_depth, [&] { scanner = start; ast.clear(); }, [&](size_t stack_bytes) {
+          auto t = stats_clock::now();
+          NodeId stmt = grammar.statement(scanner).value();
+          stats.parse_ms += ms_since(t);
+          if (!global_errors.empty()) return;
+          if (options.dump_ast) std::cout << ast.to_string(stmt) << std::endl;
+          for (auto& [kind, cnt]: count_nodes(ast, stmt)) stats.node_counts[kind] += cnt;
+          t = stats_clock::now();
+          env.stack_bytes = stack_bytes;
+          ast.gen(stmt, env);
+          stats.codegen_ms += ms_since(t);
+        });
+        if (global_errors.empty()) {
+          auto t = stats_clock::now();
+          env.code.flush(buf);
+          if (buf.size() >= flush_threshold) {
+            stats.bytes_emitted += buf.size();
+            out.write(buf);
+            buf.clear();
+          }
+          stats.emit_ms += ms_since(t);
+        }
+        ast.clear();
+        if (attempt(grammar.separator)(scanner)) continue;
+        if (eof(scanner)) break;
+        resync(scanner);
+      }
+    } catch (const ErrorLimit&) {}
+    throw_diagnostics();
+
+    auto t = stats_clock::now();
+    env.code.emit(Op::hlt);
+    env.code.flush(buf);
+    stats.bytes_emitted += buf.size();
+    out.write(buf);
+    out.write_at(header.find('0'), fmt::format("{:010}", env.get_allocated()));
+    stats.emit_ms += ms_since(t);
+
+    stats.instructions_emitted = env.code.size();
+    stats.variable_slots = env.get_allocated();
+    stats.labels_generated = env.code.label_count();
+    stats.peak_memory_kb = peak_memory_kb();
+  } catch (...) {
+    out.discard();
+    throw;
+  }
+  return stats;
+}
+
+// Keeps a program compiled across text edits. The source is split into its
+// top-level statements, each with its own span, parse tree and cached code;
+// an edit reparses and lowers only the statements it touches, extending the
+// region until parsing lines up with an untouched statement again. Variable
+// slots and label handles are never reused, so the code of untouched
+// statements stays valid as is. After a failed edit the next one recompiles
+// the whole source.
+class IncrementalCompiler {
+public:
+  explicit IncrementalCompiler(std::string source);
+
+  // Replaces `length` bytes at `offset` with `text` and recompiles.
+  void edit(size_t offset, size_t length, std::string_view text);
+  std::string code() const;
+  const std::string& source() const { return src; }
+  size_t statements() const { return units.size(); }
+  size_t last_reparsed() const { return reparsed; } // statements parsed by the last edit
+
+private:
+  struct Unit {
+    size_t begin, end; // span in src
+    Ast ast;
+    NodeId root;
+    std::string code;
+    Env::Usage usage;
+  };
+
+  // Parses statements from `from`, replacing units[first..) up to the first
+  // old unit that starts, shifted by `delta`, on a statement boundary at or
+  // after `until`.
+  void reparse(size_t first, size_t from, size_t until, ptrdiff_t delta);
+  void rebuild();
+  void check() const;
+
+  std::string src;
+  std::vector<Unit> units;
+  Interner symbols;
+  Env env;
+  bool stale = true;
+  size_t reparsed = 0;
+};
+
+// Swaps the compiler's own symbol table in as global_symbols for one edit.
+struct IncrementalScope {
+  IncrementalScope(std::string_view in, Interner& symbols): symbols(symbols) {
+    global_input = in;
+    global_errors.clear(CompileOptions{}.max_errors);
+    global_max_depth = CompileOptions{}.max_depth;
+    global_depth = 0;
+    std::swap(global_symbols, symbols);
+  }
+  ~IncrementalScope() {
+    std::swap(global_symbols, symbols);
+    Ast::current = nullptr;
+  }
+  Interner& symbols;
+};
+
+IncrementalCompiler::IncrementalCompiler(std::string source): src(std::move(source)) {
+  rebuild();
+}
+
+void IncrementalCompiler::rebuild() {
+  units.clear();
+  env = Env{};
+  env.code.reserve(1);
+  reparse(0, 0, 0, 0);
+}
+
+void IncrementalCompiler::edit(size_t offset, size_t length, std::string_view text) {
+  if (offset > src.size() || length > src.size() - offset) throw std::out_of_range("Edit is out of range.");
+  src.replace(offset, length, text);
+  try {
+    if (stale) return rebuild();
+    // The first statement ending at or after the edit; an edit in the gap
+    // before a statement may touch the separator, so start one earlier.
+    auto it = std::lower_bound(units.begin(), units.end(), offset,
+                               [](const Unit& u, size_t off) { return u.end < off; });
+    size_t first = it - units.begin();
+    if (first > 0 && (first == units.size() || offset <= units[first].begin)) --first;
+    size_t from = first == 0 ? 0 : units[first].begin;
+    reparse(first, from, offset + length, ptrdiff_t(text.size()) - ptrdiff_t(length));
+  } catch (...) {
+    stale = true;
+    throw;
   }
 }
 
+void IncrementalCompiler::reparse(size_t first, size_t from, size_t until, ptrdiff_t delta) {
+  stale = true;
+  {
+    IncrementalScope scope(src, symbols);
+    auto& grammar = default_grammar();
+    auto scanner = Scanner(src);
+    scanner.remove_prefix(from);
+    auto offset = [&](const Scanner& in) { return src.size() - in.size(); };
+
+    std::vector<Unit> fresh;
+    size_t k = first;
+    while (true) {
+      auto start = scanner;
+      skip_space(start);
+      auto& u = fresh.emplace_back(Unit{offset(start), 0, {}, empty_stmt, {}, {}});
+      Ast::current = &u.ast;
+      auto before = scanner;
+      run_nested(CompileOptions{}.max_depth, [&] { scanner = before; u.ast.clear(); }, [&](size_t stack_bytes) {
+        try {
+          u.root = grammar.statement(scanner).value();
+        } catch (const ErrorLimit&) {}
+        u.end = offset(scanner);
+        throw_diagnostics();
+        env.usage = &u.usage;
+        env.stack_bytes = stack_bytes;
+        u.ast.gen(u.root, env);
+        env.usage = nullptr;
+      });
+      env.code.flush(u.code);
+      u.usage.written.clear();
+
+      if (!attempt(grammar.separator)(scanner)) {
+        try {
+          if (!eof(scanner)) global_errors.add(scanner.furthest);
+        } catch (const ErrorLimit&) {}
+        throw_diagnostics();
+        k = units.size();
+        break;
+      }
+      auto next = scanner;
+      skip_space(next);
+      size_t pos = offset(next);
+      while (k < units.size() && (units[k].begin < until || units[k].begin + delta < pos)) ++k;
+      if (k < units.size() && units[k].begin + delta == pos) break;
+    }
+
+    reparsed = fresh.size();
+    for (size_t i = k; i < units.size(); ++i) units[i].begin += delta, units[i].end += delta;
+    units.erase(units.begin() + first, units.begin() + k);
+    units.insert(units.begin() + first, std::make_move_iterator(fresh.begin()), std::make_move_iterator(fresh.end()));
+    check();
+  }
+  stale = false;
+}
+
+// Every statement may only read variables assigned before it. Runs inside
+// IncrementalScope, while the symbol table is installed as global_symbols.
+void IncrementalCompiler::check() const {
+  auto& symbols = global_symbols;
+  std::vector<char> defined(symbols.size());
+  for (auto& u: units) {
+    for (int sym: u.usage.reads)
+      if (!defined[sym]) throw std::runtime_error(fmt::format("Reference to undefined variable {}.", symbols.name(sym)));
+    for (int sym: u.usage.writes) defined[sym] = true;
+  }
+}
+
+std::string IncrementalCompiler::code() const {
+  if (stale) throw std::runtime_error("Compile Error");
+  std::string out = fmt::format("ssp {}\n", env.get_allocated());
+  for (auto& u: units) out += u.code;
+  return out + "hlt\n";
+}
+
+// One line per instruction: its address and the source line:column it was
+// generated for, or "-".
+void write_source_map(std::ostream& os, std::string_view source, std::span<const int> locations) {
+  LineIndex lines(source);
+  std::string out;
+  auto it = std::back_inserter(out);
+  for (int addr = 0; addr < static_cast<int>(locations.size()); ++addr) {
+    if (locations[addr] < 0) fmt::format_to(it, "{} -\n", addr);
+    else fmt::format_to(it, "{} {}:{}\n", addr, lines.line(locations[addr]), lines.column(locations[addr]));
+  }
+  os << out;
+}
+
+// Entry counts of every statement by AST node id, from a profiled run of
+// `result`. Node ids only depend on the source text, so the counts can steer
+// a later compile of the same source through CompileOptions::profile.
+std::vector<uint64_t> statement_counts(const CompileResult& result, const ExecutionProfile& profile) {
+  std::vector<uint64_t> counts;
+  for (auto [node, addr]: result.entries) {
+    if (size_t(node) >= counts.size()) counts.resize(size_t(node) + 1);
+    if (size_t(addr) < profile.counts.size()) counts[node] += profile.counts[addr];
+  }
+  return counts;
+}
+
+uint64_t source_hash(std::string_view source) {
+  uint64_t h = 0xcbf29ce484222325;
+  for (unsigned char ch: source) h = (h ^ ch) * 0x100000001b3;
+  return h;
+}
+
+// Counter file: a header naming the source it belongs to, then one
+// "node count" line per executed statement.
+void write_counts(std::ostream& os, std::string_view source, const std::vector<uint64_t>& counts) {
+  os << fmt::format("zpc-profile {:016x}\n", source_hash(source));
+  for (size_t node = 0; node < counts.size(); ++node)
+    if (counts[node]) os << fmt::format("{} {}\n", node, counts[node]);
+}
+
+// Throws if the file is malformed or was recorded for another source.
+std::vector<uint64_t> read_counts(std::istream& is, std::string_view source) {
+  std::string magic, hash;
+  if (!(is >> magic >> hash) || magic != "zpc-profile") throw std::runtime_error("Not a profile counter file.");
+  if (hash != fmt::format("{:016x}", source_hash(source)))
+    throw std::runtime_error("Profile counters were recorded for a different source.");
+  std::vector<uint64_t> counts;
+  size_t node;
+  uint64_t count;
+  while (is >> node >> count) {
+    if (node >= counts.size()) counts.resize(node + 1);
+    counts[node] = count;
+  }
+  if (!is.eof()) throw std::runtime_error("Malformed profile counter file.");
+  return counts;
+}
+
+// Throws CompileError on syntax errors.
+std::string compile(std::string_view in) {
+  auto result = compile_program(in);
+  if (result.diagnostics) throw CompileError(std::move(result.diagnostics));
+  return std::move(result.code);
+}
+
 #endif //ZPC_COMPILER_HPP
@@ -1,20 +1,52 @@
 #include "env.h"
+#include "interner.h"
 #include <fmt/format.h>
+#include <cassert>
 #include <exception>
 
-int Env::get_identifier(const Identifier *identifier) {
-  auto it = sym_table.find(identifier->name);
-  if (it == sym_table.end())
-    throw std::runtime_error(fmt::format("Reference to undefined variable {}.", identifier->name));
-  return it->second;
+int Env::get_identifier(int sym) {
+  assert(sym >= 0);
+  if (usage && !usage->written.contains(sym)) usage->reads.push_back(sym);
+  if (size_t(sym) >= slots.size() || slots[sym] < 0)
+    throw std::runtime_error(fmt::format("Reference to undefined variable {}.", global_symbols.name(sym)));
+  return slots[sym];
 }
 
-void Env::register_identifier(const Identifier* identifier) {
-//  if (sym_table.contains(identifier->name))
-//    throw std::runtime_error(fmt::format("Variable {} is already defined.", identifier->name));
-  sym_table.emplace(identifier->name, sym_table.size());
+void Env::register_identifier(int sym) {
+  assert(sym >= 0);
+  if (usage && usage->written.insert(sym).second) usage->writes.push_back(sym);
+  if (size_t(sym) >= slots.size()) slots.resize(size_t(sym) + 1, -1);
+  if (slots[sym] < 0) slots[sym] = allocated++;
+}
+
+int Env::temp(size_t k) {
+  while (temps.size() <= k) temps.push_back(allocated++);
+  return temps[k];
 }
 
 void Env::open_loop() {
-  loop_st.push({gen_label("loop"), gen_label("loop")});
-}
\ No newline at end of file
+  loop_st.push({code.new_label(), code.new_label()});
+  loop_held.push(held);
+}
+
+Env Env::fork() const {
+  Env part;
+  part.slots = slots;
+  part.temps = temps;
+  part.allocated = allocated;
+  part.counts = counts;
+  part.stack_bytes = stack_bytes;
+  part.unroll = unroll;
+  part.held = held;
+  if (!loop_st.empty()) {
+    part.open_loop();
+    part.loop_held.top() = loop_held.top();
+  }
+  return part;
+}
+
+void Env::join(const Env& part) {
+  if (loop_st.empty()) return code.append(part.code, {});
+  Label loop[] = {loop_st.top().first, loop_st.top().second};
+  code.append(part.code, loop);
+}
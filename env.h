@@ -1,30 +1,83 @@
 #ifndef ZPC_ENV_H
 #define ZPC_ENV_H
-#include "ast.h"
-#include <map>
+#include "assembler.h"
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <stack>
 
-struct Identifier;
-
 class Env {
 public:
-  void register_identifier(const Identifier* identifier);
-  int get_identifier(const Identifier* identifier);
-  int get_allocated() { return sym_table.size(); }
+  void register_identifier(int sym);
+  int get_identifier(int sym);
+  int get_allocated() const { return allocated; }
   void open_loop();
   void close_loop() {
     loop_st.pop();
+    loop_held.pop();
   }
-  std::string get_loop_start() {
+  Label get_loop_start() {
     return loop_st.top().first;
   }
-  std::string get_loop_end() {
+  Label get_loop_end() {
     return loop_st.top().second;
   }
+  // Where `continue` in the innermost loop jumps from now on; each unrolled
+  // copy of a body continues to its own update.
+  void set_loop_start(Label l) {
+    loop_st.top().first = l;
+  }
+  // Operand stack values to pop before jumping out of the innermost loop.
+  int loop_unwind() const {
+    return held - loop_held.top();
+  }
+
+  Assembler code;
+  int jobs = 1; // threads for lowering large statement sequences
+  size_t stack_bytes = 0; // stack of each of those threads, 0 for the default
+  int unroll = 4; // copies of the body per iteration of a counted loop, 1 to keep loops rolled
+  int held = 0; // operand stack values kept across the statements being lowered: match scrutinees
+  // Entry counts of statements by AST node id from a profiled run, if any;
+  // codegen lays out branches, match arms and loops for the hot paths.
+  const std::vector<uint64_t>* counts = nullptr;
+
+  // Common subexpressions of the straight-line block being lowered, planned
+  // by Ast: expression node -> the scratch slot its value is stored to when
+  // first computed, or loaded from when computed again.
+  struct Reuse {
+    int temp;   // index into the scratch pool; -1 to dpl the operand just computed
+    bool store;
+  };
+  struct CsePlan {
+    std::unordered_map<int, Reuse> reuse;
+    int temps = 0;
+  };
+  const CsePlan* cse = nullptr;
+  // Slot of the k-th scratch value. Blocks share the pool, which grows
+  // as needed and is never handed out to variables.
+  int temp(size_t k);
+
+  // An Env for lowering part of this one's code on another thread: same
+  // slots, and a fresh Assembler whose first labels stand for the labels of
+  // the innermost open loop. join() appends its code here.
+  Env fork() const;
+  void join(const Env& part);
+
+  // When set, records the symbols the generated code assigns, and those it
+  // reads before assigning them itself.
+  struct Usage {
+    std::vector<int> reads, writes;
+    std::unordered_set<int> written;
+  };
+  Usage* usage = nullptr;
 private:
-  std::stack<std::pair<std::string, std::string>> loop_st;
-  std::map<std::string, int> sym_table;
+  std::stack<std::pair<Label, Label>> loop_st;
+  std::stack<int> loop_held; // held when each loop was opened
+  std::vector<int> slots; // symbol id -> variable slot, -1 if never assigned
+  std::vector<int> temps; // scratch pool
+  int allocated = 0;
 };
 
 
@@ -0,0 +1,11 @@
+#include "interner.h"
+
+Interner global_symbols;
+
+int Interner::intern(std::string_view s) {
+  auto it = ids.find(s);
+  if (it != ids.end()) return it->second;
+  int id = size();
+  ids.emplace(names.emplace_back(s), id);
+  return id;
+}
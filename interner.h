@@ -0,0 +1,26 @@
+#ifndef ZPC_INTERNER_H
+#define ZPC_INTERNER_H
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Maps identifier spellings to dense symbol ids, assigned in order of first
+// appearance. Codegen only ever sees the ids.
+class Interner {
+public:
+  int intern(std::string_view s);
+  const std::string& name(int id) const { return names[id]; }
+  int size() const { return static_cast<int>(names.size()); }
+  void clear() {
+    ids.clear();
+    names.clear();
+  }
+private:
+  std::unordered_map<std::string_view, int> ids; // keys view into `names`
+  std::deque<std::string> names;
+};
+
+extern Interner global_symbols;
+
+#endif //ZPC_INTERNER_H
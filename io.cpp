@@ -0,0 +1,91 @@
+#include "io.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <fmt/format.h>
+
+static std::runtime_error io_error(const char* what, const std::string& path) {
+  return std::runtime_error(fmt::format("Cannot {} {}: {}", what, path, strerror(errno)));
+}
+
+MappedFile::MappedFile(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw io_error("open", path);
+  struct stat st{};
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw io_error("stat", path);
+  }
+  size = st.st_size;
+  if (size > 0) {
+    void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      throw io_error("map", path);
+    }
+    madvise(p, size, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(p);
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data) munmap(const_cast<char*>(data), size);
+}
+
+OutputFile::OutputFile(const std::string& path) : path(path) {
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw io_error("create", path);
+}
+
+OutputFile::~OutputFile() {
+  if (fd >= 0) close(fd);
+}
+
+void OutputFile::write(std::string_view data) {
+  while (!data.empty()) {
+    ssize_t n = ::write(fd, data.data(), data.size());
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) throw io_error("write", path);
+    data.remove_prefix(n);
+  }
+}
+
+void OutputFile::write_at(size_t offset, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t n = pwrite(fd, data.data(), data.size(), offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) throw io_error("write", path);
+    data.remove_prefix(n);
+    offset += n;
+  }
+}
+
+void OutputFile::discard() {
+  close(fd);
+  fd = -1;
+  unlink(path.c_str());
+}
+
+void write_file(const std::string& path, std::string_view data) {
+  OutputFile{path}.write(data);
+}
+
+LineIndex::LineIndex(std::string_view text) : source(text), starts{0} {
+  for (size_t i = text.find('\n'); i != std::string_view::npos; i = text.find('\n', i + 1)) starts.push_back(i + 1);
+}
+
+int LineIndex::line(size_t offset) const {
+  return static_cast<int>(std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin());
+}
+
+std::string_view LineIndex::text(int line) const {
+  size_t begin = starts[line - 1];
+  size_t end = line < lines() ? starts[line] - 1 : source.size();
+  return source.substr(begin, end - begin);
+}
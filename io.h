@@ -0,0 +1,57 @@
+#ifndef ZPC_IO_H
+#define ZPC_IO_H
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Read-only private mapping of a whole file. The compiler scans it in place.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& path);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator = (const MappedFile&) = delete;
+
+  std::string_view view() const { return {data, size}; }
+private:
+  const char* data = nullptr;
+  size_t size = 0;
+};
+
+// A file written front to back, with in-place patches of what was already written.
+class OutputFile {
+public:
+  explicit OutputFile(const std::string& path);
+  ~OutputFile();
+  OutputFile(const OutputFile&) = delete;
+  OutputFile& operator = (const OutputFile&) = delete;
+
+  void write(std::string_view data);
+  void write_at(size_t offset, std::string_view data);
+  // Closes and deletes the file.
+  void discard();
+private:
+  std::string path;
+  int fd;
+};
+
+// Writes `data` to `path` with as few write(2) calls as the kernel allows.
+void write_file(const std::string& path, std::string_view data);
+
+// Line starts of a source text, for turning byte offsets into positions.
+class LineIndex {
+public:
+  explicit LineIndex(std::string_view text);
+
+  int lines() const { return static_cast<int>(starts.size()); }
+  // Line of byte `offset`, counting from 1.
+  int line(size_t offset) const;
+  int column(size_t offset) const { return static_cast<int>(offset - starts[line(offset) - 1]) + 1; }
+  // Text of `line`, without its line break.
+  std::string_view text(int line) const;
+private:
+  std::string_view source;
+  std::vector<size_t> starts;
+};
+
+#endif //ZPC_IO_H
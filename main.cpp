@@ -1,16 +1,142 @@
 #include "compiler.hpp"
+#include "batch.h"
+#include "io.h"
+#include "vm.h"
+#include <filesystem>
 #include <fstream>
 
-int main(int argc, char* argv[]) {
-  if (argc != 3) {
-    std::cout << "Usage: " << argv[0] << " input-file output-file" << std::endl;
+int compiler_main(int argc, char* argv[]) {
+  CompileOptions options;
+  GrammarProfiler profiler;
+  bool stats = false, profile_grammar = false, stream = false, run = false;
+  std::string folded_file, source_map_file, report_file, run_folded_file, counts_out, counts_in, batch;
+  uint64_t max_steps = 0;
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--stats") stats = true;
+    else if (arg == "--dump-ast") options.dump_ast = true;
+    else if (arg == "--stream") stream = true;
+    else if (arg == "--profile-grammar") profile_grammar = true;
+    else if (arg == "--profile-grammar-folded" && i + 1 < argc) folded_file = argv[++i];
+    else if (arg == "--jobs" && i + 1 < argc) options.jobs = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--unroll" && i + 1 < argc) options.unroll = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--max-errors" && i + 1 < argc) options.max_errors = std::max(0, std::atoi(argv[++i]));
+    else if (arg == "--source-map" && i + 1 < argc) source_map_file = argv[++i];
+    else if (arg == "--run") run = true;
+    else if (arg == "--registers") options.registers = true;
+    else if (arg == "--profile" && i + 1 < argc) report_file = argv[++i];
+    else if (arg == "--profile-folded" && i + 1 < argc) run_folded_file = argv[++i];
+    else if (arg == "--profile-generate" && i + 1 < argc) counts_out = argv[++i];
+    else if (arg == "--profile-use" && i + 1 < argc) counts_in = argv[++i];
+    else if (arg == "--batch" && i + 1 < argc) batch = argv[++i];
+    else if (arg == "--max-steps" && i + 1 < argc) max_steps = std::strtoull(argv[++i], nullptr, 10);
+    else files.emplace_back(arg);
+  }
+  bool profile = !report_file.empty() || !run_folded_file.empty() || !counts_out.empty();
+  // These need the whole program in memory, with node ids from one parse.
+  bool whole = run || profile || !source_map_file.empty() || !counts_in.empty() || !batch.empty();
+  if (files.size() != 2 || (stream && whole)) {
+    std::cout << "Usage: " << argv[0] << " [--stats] [--dump-ast] [--stream] [--profile-grammar]"
+              << " [--profile-grammar-folded file] [--jobs n] [--unroll n] [--max-errors n]"
+              << " input-file output-file\n"
+              << "       " << argv[0] << " [--source-map file] [--run [--registers]] [--profile report-file]"
+              << " [--profile-folded file] [--profile-generate file] [--profile-use file]"
+              << " input-file output-file\n"
+              << "       " << argv[0] << " --batch input-dir|- [--jobs n] [--max-steps n] input-file output-file"
+              << std::endl;
     return 1;
   }
-  std::ifstream ifs{argv[1]};
-  std::string in{std::istreambuf_iterator<char>{ifs}, {}};
-  ifs.close();
+  if (profile_grammar || !folded_file.empty()) options.grammar_profiler = &profiler;
+  MappedFile in{files[0]};
+  std::vector<uint64_t> counts;
+  if (!counts_in.empty()) {
+    std::ifstream counter_file{counts_in};
+    counts = read_counts(counter_file, in.view());
+    options.profile = &counts;
+  }
+  CompileStats result;
+  bool failed = false;
+  if (stream) {
+    try {
+      result = compile_streaming(in.view(), files[1], options);
+    } catch (const CompileError& e) {
+      write_diagnostics(std::cerr, in.view(), e.diagnostics);
+      return 1;
+    }
+  } else {
+    auto compiled = compile_program(in.view(), options);
+    if (compiled.diagnostics) {
+      write_diagnostics(std::cerr, in.view(), compiled.diagnostics);
+      return 1;
+    }
+    write_file(files[1], compiled.code);
+    result = compiled.stats;
+    if (!source_map_file.empty()) {
+      std::ofstream map{source_map_file};
+      write_source_map(map, in.view(), compiled.locations);
+    }
+    // Runs the program in process on stdin/stdout, optionally counting and
+    // timing every instruction. Profiles are of the P-code.
+    if (run && options.registers && !profile) {
+      compiled.registers->run(std::cin, std::cout);
+      std::cout.flush();
+    } else if (run || profile) {
+      ExecutionProfile counters;
+      execute(compiled.instructions, std::cin, std::cout, profile ? &counters : nullptr);
+      std::cout.flush();
+      if (!report_file.empty()) {
+        std::ofstream report{report_file};
+        counters.write_report(report, in.view(), compiled.locations, compiled.instructions);
+      }
+      if (!run_folded_file.empty()) {
+        std::ofstream folded{run_folded_file};
+        counters.write_folded(folded, in.view(), compiled.locations, compiled.instructions);
+      }
+      if (!counts_out.empty()) {
+        std::ofstream counter_file{counts_out};
+        write_counts(counter_file, in.view(), statement_counts(compiled, counters));
+      }
+    }
+    // Runs the program once per file of the directory, or per path read
+    // from stdin with "-", on --jobs threads. Outputs follow in input order,
+    // each under its file name.
+    if (!batch.empty()) {
+      std::vector<std::string> inputs;
+      if (batch == "-") {
+        for (std::string line; std::getline(std::cin, line);)
+          if (!line.empty()) inputs.push_back(line);
+      } else {
+        for (auto& entry: std::filesystem::directory_iterator(batch))
+          if (entry.is_regular_file()) inputs.push_back(entry.path().string());
+        std::sort(inputs.begin(), inputs.end());
+      }
+      FusedProgram program(compiled.instructions);
+      run_batch(program, inputs.size(), [&](size_t i) { return std::string(MappedFile(inputs[i]).view()); },
+                {.jobs = options.jobs, .max_steps = max_steps}, [&](size_t i, BatchRun& r) {
+        std::cout << "==> " << inputs[i] << " <==\n" << r.output;
+        if (!r.error.empty()) std::cout << "error: " << r.error << '\n';
+        failed = failed || !r.error.empty();
+      });
+    }
+  }
+  if (stats) std::cerr << result;
+  if (profile_grammar) profiler.write_table(std::cerr);
+  if (!folded_file.empty()) {
+    std::ofstream folded{folded_file};
+    profiler.write_folded(folded);
+  }
+  return failed;
+}
 
-  std::ofstream ofs{argv[2]};
-  ofs << compile(in);
-  ofs.close();
+// Errors without a source location, such as undefined variables or
+// unreadable files, end the process with their message.
+int main(int argc, char* argv[]) {
+  try {
+    return compiler_main(argc, argv);
+  } catch (const std::exception& e) {
+    std::cout.flush();
+    std::cerr << "error: " << e.what() << std::endl;
+    return 1;
+  }
 }
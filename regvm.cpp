@@ -0,0 +1,460 @@
+#include "regvm.h"
+#include "env.h"
+#include <fmt/format.h>
+#include <algorithm>
+#include <istream>
+#include <limits>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+  constexpr int max_registers = 1 << 16;
+  constexpr size_t unbound = std::numeric_limits<size_t>::max();
+
+  bool is_comparison(BinOp op) { return op >= BinOp::grt && op <= BinOp::neq; }
+
+  BinOp inverse(BinOp op) {
+    switch (op) {
+      case BinOp::grt: return BinOp::leq;
+      case BinOp::les: return BinOp::geq;
+      case BinOp::geq: return BinOp::les;
+      case BinOp::leq: return BinOp::grt;
+      case BinOp::equ: return BinOp::neq;
+      default: return BinOp::equ;
+    }
+  }
+}
+
+// Statements are lowered by recursion, as in Ast::gen(), and expressions in
+// post order from an explicit stack.
+class RegisterProgram::Builder {
+public:
+  Builder(const Ast& ast, RegisterProgram& p): ast(ast), p(p) {}
+
+  void lower(NodeId root) {
+    ast.assign_slots(root, env);
+    p.literals = env.get_allocated();
+    std::map<int, int> values; // literal -> register
+    std::vector<NodeId> todo{root};
+    while (!todo.empty()) {
+      NodeId n = todo.back();
+      todo.pop_back();
+      if (ast.kind(n) == NodeKind::num) values.emplace(ast.value(n), 0);
+      if (ast.kind(n) == NodeKind::unary_op && UnOp(ast.value(n)) != UnOp::not_) values.emplace(1, 0);
+      if (ast.kind(n) == NodeKind::unary_op && UnOp(ast.value(n)) == UnOp::odd) values.emplace(2, 0);
+      for (auto c: ast.children(n)) todo.push_back(c);
+    }
+    base = p.literals;
+    for (auto& [v, r]: values) r = base++;
+    if (base > max_registers) throw too_many();
+    p.temporaries = base;
+    literal = std::move(values);
+
+    stmt(root);
+    emit(Op::hlt);
+    p.init.assign(base + peak, 0);
+    for (auto [v, r]: literal) p.init[r] = v;
+  }
+
+private:
+  static std::runtime_error too_many() {
+    return std::runtime_error(fmt::format("Program needs more than {} registers.", max_registers));
+  }
+
+  void emit(Op op) {
+    p.code.push_back(uint8_t(op));
+    ++p.insns;
+  }
+  void reg(int r) {
+    p.code.push_back(uint8_t(r));
+    p.code.push_back(uint8_t(r >> 8));
+  }
+  void put32(size_t at, uint32_t v) {
+    for (int k = 0; k < 4; ++k) p.code[at + k] = uint8_t(v >> 8 * k);
+  }
+  void target(int label) {
+    auto& l = labels[label];
+    size_t at = p.code.size();
+    p.code.resize(at + 4);
+    if (l.at == unbound) l.uses.push_back(at);
+    else put32(at, uint32_t(l.at));
+  }
+
+  int new_label() {
+    labels.emplace_back();
+    return static_cast<int>(labels.size()) - 1;
+  }
+  void bind(int label) {
+    auto& l = labels[label];
+    l.at = p.code.size();
+    for (size_t at: l.uses) put32(at, uint32_t(l.at));
+    l.uses.clear();
+  }
+
+  void three(Op op, int d, int a, int b) { emit(op); reg(d); reg(a); reg(b); }
+  void two(Op op, int d, int a) { emit(op); reg(d); reg(a); }
+  void jump(int label) { emit(Op::jmp); target(label); }
+
+  int var(NodeId id) { return env.get_identifier(ast.value(id)); }
+  int temp() {
+    if (base + top >= max_registers) throw too_many();
+    peak = std::max(peak, ++top);
+    return base + top - 1;
+  }
+  // Temporaries are freed in the reverse order they were taken, so freeing
+  // one frees every temporary above it.
+  void release(int r) {
+    if (r >= base) top = std::min(top, r - base);
+  }
+  int copy(int r) {
+    int t = temp();
+    two(Op::mov, t, r);
+    return t;
+  }
+
+  // Whether statement or expression n may change register r.
+  bool changes(NodeId n, int r) {
+    std::vector<NodeId> todo{n};
+    while (!todo.empty()) {
+      n = todo.back();
+      todo.pop_back();
+      auto c = ast.children(n);
+      switch (ast.kind(n)) {
+        case NodeKind::assign_stmt:
+        case NodeKind::read_stmt:
+          if (var(c[0]) == r) return true;
+          break;
+        case NodeKind::unary_op:
+          if (UnOp(ast.value(n)) != UnOp::inc && UnOp(ast.value(n)) != UnOp::dec) break;
+          if (var(c[0]) == r) return true;
+          continue;
+        default:
+          break;
+      }
+      for (auto k: c) todo.push_back(k);
+    }
+    return false;
+  }
+
+  // The register holding the value of expression `root`. Its own operation,
+  // if it has one, writes `dst` when that is given. Variables and literals
+  // are their own registers and cost no instruction.
+  int expr(NodeId root, int dst = -1) {
+    std::vector<std::pair<NodeId, int>> todo{{root, 0}}; // node, operands done
+    std::vector<int> values;
+    auto result = [&](NodeId n) { return n == root && dst >= 0 ? dst : temp(); };
+    while (!todo.empty()) {
+      auto [n, done] = todo.back();
+      todo.pop_back();
+      auto c = ast.children(n);
+      switch (ast.kind(n)) {
+        case NodeKind::identifier:
+          values.push_back(var(n));
+          break;
+        case NodeKind::num:
+          values.push_back(literal.at(ast.value(n)));
+          break;
+        case NodeKind::binary_op:
+          if (done == 0) {
+            todo.push_back({n, 1});
+            todo.push_back({c[0], 0});
+          } else if (done == 1) {
+            // ++ or -- on the right may change the variable the left operand
+            // names; P-code has already pushed its value.
+            if (ast.canon(c[1]) < 0 && values.back() < p.literals) values.back() = copy(values.back());
+            todo.push_back({n, 2});
+            todo.push_back({c[1], 0});
+          } else {
+            int b = values.back();
+            values.pop_back();
+            int a = values.back();
+            values.pop_back();
+            release(a);
+            release(b);
+            int d = result(n);
+            three(Op(ast.value(n)), d, a, b);
+            values.push_back(d);
+          }
+          break;
+        case NodeKind::unary_op:
+          if (UnOp(ast.value(n)) == UnOp::inc || UnOp(ast.value(n)) == UnOp::dec) {
+            int x = var(c[0]);
+            three(UnOp(ast.value(n)) == UnOp::inc ? Op::add : Op::sub, x, x, literal.at(1));
+            values.push_back(x);
+          } else if (done == 0) {
+            todo.push_back({n, 1});
+            todo.push_back({c[0], 0});
+          } else {
+            int a = values.back();
+            release(a);
+            int d = result(n);
+            if (UnOp(ast.value(n)) == UnOp::not_) {
+              two(Op::not_, d, a);
+            } else { // odd: (e % 2) == 1
+              three(Op::mod, d, a, literal.at(2));
+              three(Op::equ, d, d, literal.at(1));
+            }
+            values.back() = d;
+          }
+          break;
+        default:
+          throw std::runtime_error(fmt::format("{} is not an expression.", kind_name(ast.kind(n))));
+      }
+    }
+    return values.back();
+  }
+
+  // Jumps to `label` when cond is `when`. Comparisons test and jump in one
+  // instruction.
+  void branch(NodeId cond, bool when, int label) {
+    for (; ast.kind(cond) == NodeKind::unary_op && UnOp(ast.value(cond)) == UnOp::not_; when = !when)
+      cond = ast.children(cond)[0];
+    auto c = ast.children(cond);
+    if (ast.kind(cond) == NodeKind::binary_op && is_comparison(BinOp(ast.value(cond)))) {
+      int a = expr(c[0]);
+      if (ast.canon(c[1]) < 0 && a < p.literals) a = copy(a);
+      int b = expr(c[1]);
+      release(a);
+      release(b);
+      auto op = when ? inverse(BinOp(ast.value(cond))) : BinOp(ast.value(cond));
+      emit(Op(int(Op::jf_grt) + int(op) - int(BinOp::grt)));
+      reg(a);
+      reg(b);
+      target(label);
+      return;
+    }
+    int r = expr(cond);
+    release(r);
+    emit(when ? Op::jt : Op::jf);
+    reg(r);
+    target(label);
+  }
+
+  void stmt(NodeId n) {
+    auto c = ast.children(n);
+    switch (ast.kind(n)) {
+      case NodeKind::empty_expr:
+      case NodeKind::empty_stmt:
+        break;
+
+      case NodeKind::identifier:
+      case NodeKind::binary_op:
+      case NodeKind::unary_op:
+      case NodeKind::num:
+        release(expr(n));
+        break;
+
+      case NodeKind::assign_stmt: {
+        int x = var(c[0]);
+        int r = expr(c[1], x);
+        if (r != x) two(Op::mov, x, r);
+        release(r);
+        break;
+      }
+
+      case NodeKind::read_stmt:
+        emit(Op::in);
+        reg(var(c[0]));
+        break;
+
+      case NodeKind::write_stmt: {
+        int r = expr(c[0]);
+        release(r);
+        emit(Op::write);
+        reg(r);
+        break;
+      }
+
+      case NodeKind::if_stmt: {
+        auto else_label = new_label(), end_label = new_label();
+        branch(c[0], false, else_label);
+        stmt(c[1]);
+        if (c[2] != empty_stmt) jump(end_label);
+        bind(else_label);
+        stmt(c[2]);
+        bind(end_label);
+        break;
+      }
+
+      case NodeKind::stmt_sequence:
+        for (auto s: c) stmt(s);
+        break;
+
+      case NodeKind::for_stmt: { // for (s1; s2; s3) s4, with the test at the bottom
+        auto start_label = new_label(), test_label = new_label();
+        loops.push_back({new_label(), new_label()});
+        auto [continue_label, end_label] = loops.back();
+        stmt(c[0]);
+        jump(test_label);
+        bind(start_label);
+        stmt(c[3]);
+        bind(continue_label);
+        stmt(c[2]);
+        bind(test_label);
+        branch(c[1], true, start_label);
+        bind(end_label);
+        loops.pop_back();
+        break;
+      }
+
+      case NodeKind::case_stmt: {
+        auto end_label = new_label();
+        int s = expr(c[0]);
+        // P-code tests the value the scrutinee had on entry.
+        if (s < p.literals && changes(n, s)) s = copy(s);
+        for (size_t i = 1; i < c.size(); i += 2) {
+          auto next_label = new_label();
+          int v = expr(c[i]);
+          release(v);
+          emit(Op::jf_equ);
+          reg(s);
+          reg(v);
+          target(next_label);
+          stmt(c[i + 1]);
+          jump(end_label);
+          bind(next_label);
+        }
+        bind(end_label);
+        release(s);
+        break;
+      }
+
+      case NodeKind::break_stmt:
+      case NodeKind::continue_stmt:
+        if (loops.empty())
+          throw std::runtime_error(ast.kind(n) == NodeKind::break_stmt ? "break outside of a loop." : "continue outside of a loop.");
+        jump(ast.kind(n) == NodeKind::break_stmt ? loops.back().second : loops.back().first);
+        break;
+
+      case NodeKind::exit_stmt:
+        emit(Op::hlt);
+        break;
+    }
+  }
+
+  struct Label {
+    size_t at = unbound;
+    std::vector<size_t> uses; // operands to patch once bound
+  };
+
+  const Ast& ast;
+  RegisterProgram& p;
+  Env env;
+  std::map<int, int> literal; // value -> register
+  int base = 0;               // first temporary
+  int top = 0, peak = 0;      // temporaries in use, most at once
+  std::vector<Label> labels;
+  std::vector<std::pair<int, int>> loops; // continue and break labels, innermost last
+};
+
+RegisterProgram::RegisterProgram(const Ast& ast, NodeId root) {
+  Builder(ast, *this).lower(root);
+}
+
+template<bool counted>
+void RegisterProgram::run_registers(std::istream& in, std::ostream& out, uint64_t* dispatches) const {
+  std::vector<int> regs(init);
+  int* r = regs.data();
+  const uint8_t* start = code.data();
+  const uint8_t* pc = start;
+  auto u16 = [&](int k) { return pc[k] | pc[k + 1] << 8; };
+  auto u32 = [&](int k) {
+    return uint32_t(pc[k]) | uint32_t(pc[k + 1]) << 8 | uint32_t(pc[k + 2]) << 16 | uint32_t(pc[k + 3]) << 24;
+  };
+  auto three = [&](auto f) {
+    r[u16(1)] = f(r[u16(3)], r[u16(5)]);
+    pc += 7;
+  };
+  auto divisor = [](int a, int b) {
+    if (b == 0) throw std::runtime_error("Division by zero.");
+    if (b == -1 && a == std::numeric_limits<int>::min()) throw std::runtime_error("Division overflow.");
+    return b;
+  };
+  auto jf = [&](bool ok) { pc = ok ? pc + 9 : start + u32(5); };
+  uint64_t n = 0;
+  while (true) {
+    if constexpr (counted) ++n;
+    switch (Op(*pc)) {
+      case Op::add: three([](int a, int b) { return int(unsigned(a) + unsigned(b)); }); break;
+      case Op::sub: three([](int a, int b) { return int(unsigned(a) - unsigned(b)); }); break;
+      case Op::mul: three([](int a, int b) { return int(unsigned(a) * unsigned(b)); }); break;
+      case Op::div: three([&](int a, int b) { return a / divisor(a, b); }); break;
+      case Op::mod: three([&](int a, int b) { return a % divisor(a, b); }); break;
+      case Op::grt: three([](int a, int b) { return int(a > b); }); break;
+      case Op::les: three([](int a, int b) { return int(a < b); }); break;
+      case Op::geq: three([](int a, int b) { return int(a >= b); }); break;
+      case Op::leq: three([](int a, int b) { return int(a <= b); }); break;
+      case Op::equ: three([](int a, int b) { return int(a == b); }); break;
+      case Op::neq: three([](int a, int b) { return int(a != b); }); break;
+      case Op::and_: three([](int a, int b) { return int(a && b); }); break;
+      case Op::or_: three([](int a, int b) { return int(a || b); }); break;
+      case Op::xor_: three([](int a, int b) { return int(bool(a) != bool(b)); }); break;
+      case Op::not_: r[u16(1)] = !r[u16(3)]; pc += 5; break;
+      case Op::mov: r[u16(1)] = r[u16(3)]; pc += 5; break;
+      case Op::in: {
+        int x;
+        if (!(in >> x)) throw std::runtime_error("Cannot read an integer from the input.");
+        r[u16(1)] = x;
+        pc += 3;
+        break;
+      }
+      case Op::write: out << r[u16(1)] << '\n'; pc += 3; break;
+      case Op::jmp: pc = start + u32(1); break;
+      case Op::jf: pc = r[u16(1)] ? pc + 7 : start + u32(3); break;
+      case Op::jt: pc = r[u16(1)] ? start + u32(3) : pc + 7; break;
+      case Op::jf_grt: jf(r[u16(1)] > r[u16(3)]); break;
+      case Op::jf_les: jf(r[u16(1)] < r[u16(3)]); break;
+      case Op::jf_geq: jf(r[u16(1)] >= r[u16(3)]); break;
+      case Op::jf_leq: jf(r[u16(1)] <= r[u16(3)]); break;
+      case Op::jf_equ: jf(r[u16(1)] == r[u16(3)]); break;
+      case Op::jf_neq: jf(r[u16(1)] != r[u16(3)]); break;
+      case Op::hlt:
+        if constexpr (counted) {
+          if (dispatches) *dispatches += n;
+        }
+        return;
+    }
+  }
+}
+
+void RegisterProgram::run(std::istream& in, std::ostream& out, uint64_t* dispatches) const {
+  if (dispatches) return run_registers<true>(in, out, dispatches);
+  run_registers<false>(in, out, nullptr);
+}
+
+std::string RegisterProgram::disassemble() const {
+  static const char* names[] = {
+    "add", "sub", "mul", "div", "mod", "grt", "les", "geq", "leq", "equ", "neq", "and", "or", "xor",
+    "not", "mov", "in", "write", "jmp", "jf", "jt",
+    "jf_grt", "jf_les", "jf_geq", "jf_leq", "jf_equ", "jf_neq",
+    "hlt",
+  };
+  std::string s;
+  auto it = std::back_inserter(s);
+  for (int k = literals; k < temporaries; ++k) fmt::format_to(it, "const r{} {}\n", k, init[k]);
+  for (size_t at = 0; at < code.size();) {
+    auto op = Op(code[at]);
+    fmt::format_to(it, "{}: {}", at, names[int(op)]);
+    auto reg = [&] {
+      fmt::format_to(it, " r{}", code[at] | code[at + 1] << 8);
+      at += 2;
+    };
+    auto label = [&] {
+      uint32_t t = 0;
+      for (int k = 0; k < 4; ++k) t |= uint32_t(code[at + k]) << 8 * k;
+      fmt::format_to(it, " {}", t);
+      at += 4;
+    };
+    ++at;
+    if (op <= Op::xor_) reg(), reg(), reg();
+    else if (op == Op::not_ || op == Op::mov) reg(), reg();
+    else if (op == Op::in || op == Op::write) reg();
+    else if (op == Op::jmp) label();
+    else if (op == Op::jf || op == Op::jt) reg(), label();
+    else if (op != Op::hlt) reg(), reg(), label();
+    s += '\n';
+  }
+  return s;
+}
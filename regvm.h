@@ -0,0 +1,61 @@
+#ifndef ZPC_REGVM_H
+#define ZPC_REGVM_H
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+#include "ast.h"
+
+// Three-address register bytecode, lowered straight from the Ast as an
+// alternative to P-code. Every variable lives in the register numbered by
+// its Env slot and every literal in a register loaded with it before the
+// first instruction, so operands are named rather than pushed:
+// `x := x + y` is the single instruction `add x x y`. Intermediate values
+// go to temporaries, allocated as a stack above those registers.
+//
+// Instructions are an opcode byte followed by their operands, registers
+// as 2 bytes and jump targets as 4-byte code offsets, little-endian:
+//   add .. xor      d a b    d = a op b, operators in BinOp order
+//   not, mov        d a      d = !a, d = a
+//   in              d        d = next integer of the input
+//   write           a        a, then a line break
+//   jmp             t
+//   jf, jt          a t      goto t if a is false, true
+//   jf_grt .. jf_neq  a b t  goto t unless a op b
+//   hlt
+class RegisterProgram {
+public:
+  // Lowers statement `root` of `ast`, whose symbols must still be the ones
+  // in global_symbols. Throws the errors P-code generation throws, and
+  // std::runtime_error if the program needs more than 65536 registers.
+  RegisterProgram(const Ast& ast, NodeId root);
+
+  // Same semantics as execute() on the P-code of the program. Adds the
+  // instructions dispatched to `dispatches`, if given.
+  void run(std::istream& in, std::ostream& out, uint64_t* dispatches = nullptr) const;
+
+  size_t size() const { return insns; }        // instructions
+  size_t bytes() const { return code.size(); } // encoded
+  int registers() const { return static_cast<int>(init.size()); }
+  // A `const rN value` line per literal register, then one line per
+  // instruction: its offset, opcode and operands.
+  std::string disassemble() const;
+
+private:
+  enum class Op : uint8_t {
+    add, sub, mul, div, mod, grt, les, geq, leq, equ, neq, and_, or_, xor_,
+    not_, mov, in, write, jmp, jf, jt,
+    jf_grt, jf_les, jf_geq, jf_leq, jf_equ, jf_neq,
+    hlt,
+  };
+  class Builder;
+  template<bool counted>
+  void run_registers(std::istream& in, std::ostream& out, uint64_t* dispatches) const;
+
+  std::vector<uint8_t> code;
+  std::vector<int> init; // every register before the first instruction: its literal, or 0
+  int literals = 0, temporaries = 0; // registers [literals, temporaries) hold literals
+  size_t insns = 0;
+};
+
+#endif //ZPC_REGVM_H
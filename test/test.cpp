@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 #include <fstream>
 #include "compiler.hpp"
+#include "batch.h"
+#include "io.h"
+#include "vm.h"
 
 // https://stackoverflow.com/questions/478898/how-do-i-execute-a-command-and-get-the-output-of-the-command-within-c-using-po
 std::string exec(const char* cmd) {
@@ -132,6 +135,38 @@ TEST(case_statement, z) {
       case 3 => write 3
     end
   )"), "2\n");
+
+  // Leaving a match through a matched arm, break or continue pops the
+  // scrutinee: the operand stack has one depth at every address.
+  auto src = "s := 0; for i := 0; i < 30; i := i + 1 do match i % 3 of case 0 => continue case 1 =>"
+             " if i > 20 then break end end; match i of case 5 => s := s + 100 end; s := s + i end; write s";
+  EXPECT_EQ(go(src), "247\n");
+  auto code = compile_program(src).instructions;
+  std::vector<int> depth(code.size() + 1, -1);
+  std::vector<int> todo{0};
+  depth[0] = 0;
+  auto reach = [&](int at, int d) {
+    if (depth[at] == -1) {
+      depth[at] = d;
+      todo.push_back(at);
+    }
+    EXPECT_EQ(depth[at], d) << "at " << at;
+  };
+  while (!todo.empty()) {
+    int at = todo.back();
+    todo.pop_back();
+    auto [op, arg] = code[at];
+    int d = depth[at];
+    switch (op) {
+      case Op::ssp: reach(at + 1, arg); break;
+      case Op::ldc_i: case Op::ldc_c: case Op::lod: case Op::dpl: case Op::in: reach(at + 1, d + 1); break;
+      case Op::not_: reach(at + 1, d); break;
+      case Op::fjp: reach(arg, d - 1); reach(at + 1, d - 1); break;
+      case Op::ujp: reach(arg, d); break;
+      case Op::hlt: break;
+      default: reach(at + 1, d - 1); break; // str, binary operators, pop, out
+    }
+  }
 }
 
 TEST(exit, z) {
@@ -165,4 +200,602 @@ TEST(prime, z) {
       if flag == 1 then write i end
     end
   )"), "2\n3\n5\n7\n11\n13\n17\n19\n23\n29\n31\n37\n41\n43\n47\n53\n59\n61\n67\n71\n73\n79\n83\n89\n97\n");
-}
\ No newline at end of file
+}
+TEST(stats, z) {
+  auto result = compile_program("x := 1; if x < 2 then write x end");
+  auto& s = result.stats;
+  EXPECT_EQ(s.variable_slots, 1);
+  EXPECT_EQ(s.labels_generated, 2);
+  EXPECT_EQ(s.bytes_emitted, result.code.size());
+  EXPECT_EQ(s.instructions_emitted, 13);
+  EXPECT_EQ(s.node_counts["AssignStmt"], 1);
+  EXPECT_EQ(s.node_counts["Identifier"], 3);
+  EXPECT_EQ(s.node_counts["Num"], 2);
+  EXPECT_GT(s.peak_memory_kb, 0);
+}
+
+TEST(grammar_profiler, z) {
+  GrammarProfiler profiler;
+  compile_program("reader := 1; write reader", {.grammar_profiler = &profiler});
+  auto& rules = profiler.stats();
+  EXPECT_EQ(rules.at("program").successes, 1);
+  EXPECT_EQ(rules.at("statement").successes, 2);
+  EXPECT_EQ(rules.at("assign_stmt").successes, 1);
+  EXPECT_EQ(rules.at("write_stmt").successes, 1);
+  EXPECT_GE(rules.at("read_stmt").failures, 2);
+  EXPECT_EQ(rules.at("program").consumed, 25);
+  EXPECT_EQ(rules.at("read_stmt").rescanned, 4); // "read" matches before the keyword check fails
+  std::ostringstream folded;
+  profiler.write_folded(folded);
+  EXPECT_NE(folded.str().find("program;stmt_sequence;statement;write_stmt"), std::string::npos);
+}
+
+TEST(symbols, z) {
+  EXPECT_EQ(go("ab := 1; a := 2; abc := 3; write ab; write a; write abc"), "1\n2\n3\n");
+  EXPECT_THROW(go("a := 1; write b"), std::runtime_error);
+  auto result = compile_program("x := 1; y := x; x := y; write y");
+  EXPECT_EQ(result.stats.variable_slots, 2);
+  EXPECT_EQ(global_symbols.intern("y"), 1);
+}
+
+TEST(assembler, z) {
+  Assembler code;
+  auto top = code.new_label(), end = code.new_label();
+  code.bind(top);
+  code.emit(Op::ldc_i, 1);
+  code.jump(Op::fjp, end);
+  code.jump(Op::ujp, top);
+  code.bind(end);
+  code.emit(Op::hlt);
+  EXPECT_EQ(code.instructions()[1].arg, 3); // forward jump backpatched by bind()
+  EXPECT_EQ(code.instructions()[2].arg, 0);
+  EXPECT_EQ(code.render(), "L0:\nldc i 1\nfjp L1\nujp L0\nL1:\nhlt\n");
+}
+
+TEST(precedence, z) {
+  EXPECT_EQ(go("write 10 - 3 - 2"), "5\n");
+  EXPECT_EQ(go("write 100 / 10 / 5"), "2\n");
+  EXPECT_EQ(go("write 2 + 3 * 4 % 5"), "4\n");
+  EXPECT_EQ(go("write (2 + 3) * 4"), "20\n");
+  EXPECT_EQ(go("if 1 > 2 and 1 > 2 or 2 > 1 then write 1 else write 0 end"), "1\n");
+  EXPECT_EQ(go("andy := 1; if andy == 1 and not (andy > 1) then write andy end"), "1\n");
+  EXPECT_THROW(go("write 1 /* unterminated"), std::runtime_error);
+}
+
+TEST(mapped_input, z) {
+  write_file("tmp_src.txt", "x := 41;\nwrite x + 1");
+  {
+    MappedFile in{"tmp_src.txt"};
+    EXPECT_EQ(in.view(), "x := 41;\nwrite x + 1");
+    EXPECT_EQ(compile(in.view()), compile("x := 41; write x + 1"));
+  }
+  std::remove("tmp_src.txt");
+  EXPECT_THROW(MappedFile{"no_such_file.txt"}, std::runtime_error);
+  auto range = compile_program("x := 1;\nwrite x + 99999999999; write 1 +").diagnostics;
+  ASSERT_EQ(range.errors.size(), 2);
+  EXPECT_EQ(range.errors[0].line, 2);
+  EXPECT_EQ(range.errors[0].column, 11);
+  EXPECT_EQ(range.errors[0].message, "Integer literal 99999999999 is out of range.");
+  EXPECT_EQ(range.errors[1].message, "Unexpected end of input.");
+  EXPECT_THROW(compile("write 99999999999"), CompileError);
+}
+
+std::string run(const std::string& p_code_file, const std::string& input = "") {
+  auto command = "./Pmachine " + p_code_file;
+  if (!input.empty()) command = "echo '" + input + "' | " + command;
+  auto output = exec(command.c_str());
+  return output.substr(0, output.rfind("\n--> Execution time"));
+}
+
+// What `result` writes when execute() runs it on `input`.
+std::string output(const CompileResult& result, ExecutionProfile* profile = nullptr, const std::string& input = "") {
+  std::istringstream in{input};
+  std::ostringstream out;
+  execute(result.instructions, in, out, profile);
+  return out.str();
+}
+
+// Compiles `src` with `options` and runs it on `input` through `engine`,
+// which returns the instructions it dispatched. Expects the output Pmachine
+// gives and fewer dispatches than execute() runs P-code instructions.
+template<class Engine>
+void expect_like_pmachine(const std::string& src, const std::string& input, const CompileOptions& options,
+                          Engine engine) {
+  auto compiled = compile_program(src, options);
+  write_file("tmp.txt", compiled.code);
+  std::istringstream in{input};
+  std::ostringstream out;
+  uint64_t dispatches = engine(compiled, in, out);
+  EXPECT_EQ(out.str(), run("tmp.txt", input)) << src;
+  ExecutionProfile profile;
+  output(compiled, &profile, input);
+  EXPECT_LT(dispatches, profile.total_count()) << src;
+}
+
+// Loops, match arms left through break and continue, and input.
+const std::vector<std::string> engine_programs{
+  "x := 72; y := 192; while y != 0 do t := y; y := x % y; x := t end; write x",
+  "s := 0; for i := 0; i < 50; i := i + 1 do match i % 4 of case 0 => s := s + 2 case 1 => s := s - 1"
+  " case 3 => s := s + i end end; write s",
+  "s := 0; for i := 0; i < 30; i := i + 1 do match i % 3 of case 0 => continue case 1 =>"
+  " if i > 20 then break end end; s := s + i end; write s; write i",
+  "n := 7; read x; if not (x < n) then write x * 2 else write 0 - x end; write x - n",
+};
+
+TEST(streaming, z) {
+  std::string src = R"(
+    x := 72; y := 192;
+    while y != 0 do t := y; y := x % y; x := t end;
+    write x;
+    for i := 1; i < 4; i := i + 1 do
+      match i of case 1 => write 10 case 3 => write 30 end
+    end
+  )";
+  auto stats = compile_streaming(src, "tmp_stream.txt");
+  EXPECT_EQ(stats.variable_slots, 4);
+  EXPECT_EQ(stats.node_counts["ForStmt"], 2); // while loops lower to ForStmt
+  write_file("tmp.txt", compile(src));
+  EXPECT_EQ(run("tmp_stream.txt"), run("tmp.txt"));
+  EXPECT_EQ(run("tmp_stream.txt"), "24\n10\n30\n");
+  EXPECT_THROW(compile_streaming("write 1; write z", "tmp_stream.txt"), std::runtime_error);
+  EXPECT_THROW(compile_streaming("write 1; wr ite 2", "tmp_stream.txt"), std::runtime_error);
+  EXPECT_FALSE(std::ifstream("tmp_stream.txt").good());
+}
+
+TEST(incremental, z) {
+  std::string src = "x := 3;\ny := 4;\nif x < y then write x else write y end;\nwrite x * y";
+  IncrementalCompiler ic(src);
+  EXPECT_EQ(ic.statements(), 4);
+  auto before = ic.code();
+
+  // Editing one statement reparses only that statement; the others keep their code.
+  ic.edit(src.find("4"), 1, "1");
+  EXPECT_EQ(ic.last_reparsed(), 1);
+  auto after = ic.code();
+  EXPECT_EQ(before.substr(before.find("fjp")), after.substr(after.find("fjp")));
+  write_file("tmp.txt", after);
+  EXPECT_EQ(run("tmp.txt"), "1\n3\n");
+
+  // Merging statements, inserting new ones and a new variable.
+  ic.edit(ic.source().find(";\ny"), 2, "+ 1; z := 2;\n");
+  ic.edit(ic.source().size(), 0, "; write z");
+  write_file("tmp.txt", ic.code());
+  EXPECT_EQ(run("tmp.txt"), "1\n4\n2\n");
+  write_file("tmp.txt", compile(ic.source()));
+  EXPECT_EQ(run("tmp.txt"), "1\n4\n2\n");
+
+  // A failed edit leaves no code until a later edit fixes the source.
+  EXPECT_THROW(ic.edit(0, ic.source().find("z"), ""), std::runtime_error); // removes the assignment of x
+  EXPECT_THROW(ic.code(), std::runtime_error);
+  ic.edit(0, 0, "x := 5;");
+  write_file("tmp.txt", ic.code());
+  EXPECT_EQ(run("tmp.txt"), "1\n5\n2\n");
+  EXPECT_THROW(ic.edit(0, 2, "x :="), std::runtime_error);
+}
+
+TEST(flat_ast, z) {
+  Ast ast;
+  int x = global_symbols.intern("x");
+  auto cond = ast.binary(ast.identifier(x), BinOp::les, ast.num(3));
+  auto body = ast.sequence(std::vector{ast.write(ast.identifier(x)), ast.break_()});
+  auto loop = ast.for_(empty_stmt, cond, empty_stmt, body);
+  EXPECT_EQ(ast.kind(loop), NodeKind::for_stmt);
+  EXPECT_EQ(ast.children(loop).size(), 4);
+  EXPECT_EQ(ast.children(body)[1], body - 1); // children come before their parent
+  EXPECT_EQ(ast.value(ast.children(cond)[1]), 3);
+  EXPECT_EQ(ast.to_string(loop),
+            "For(Init: , Cond: (Identifier(x) < Num(3)), Update: , Body: {\n  Write(Identifier(x))\n  Break\n})");
+  ast.clear();
+  EXPECT_EQ(ast.size(), 2);
+}
+
+TEST(parallel_codegen, z) {
+  std::string src = "i := 0; s := 0";
+  for (int k = 0; k < 600; ++k) {
+    src += fmt::format("; v{0} := {0} * (i + 1); if odd v{0} then s := s + v{0} else s := s - 1 end", k % 50);
+    if (k % 100 == 0) src += "; match s % 3 of case 0 => write s case 1 => s := s + 1 end";
+  }
+  // A large loop body, with break and continue inside parallel chunks.
+  src += "; while i < 5 do i := i + 1";
+  for (int k = 0; k < 800; ++k) {
+    src += fmt::format("; w{0} := i * {0} + s", k % 70);
+    if (k == 200) src += "; if i == 2 then continue end";
+    if (k == 400) src += "; if i == 4 then break end";
+  }
+  src += "; write w3 end; write s";
+
+  auto serial = compile(src);
+  for (int jobs: {2, 3, 8}) EXPECT_EQ(compile_program(src, {.jobs = jobs}).code, serial);
+  EXPECT_THROW(compile_program(src + "; write nope", {.jobs = 4}), std::runtime_error);
+}
+
+TEST(execution_profile, z) {
+  std::string src = "s := 0;\nfor i := 0; i < 10; i := i + 1 do\n  s := s + i\nend;\nwrite s";
+  auto result = compile_program(src, {.unroll = 1});
+  LineIndex lines(src);
+  auto line_at = [&](int addr) { return lines.line(result.locations[addr]); };
+  EXPECT_EQ(result.locations.front(), -1); // ssp
+  EXPECT_EQ(line_at(1), 1);
+  EXPECT_EQ(line_at(int(result.instructions.size()) - 2), 5);
+
+  ExecutionProfile profile;
+  std::istringstream in;
+  std::ostringstream out;
+  execute(result.instructions, in, out, &profile);
+  write_file("tmp.txt", result.code);
+  EXPECT_EQ(out.str(), "45\n");
+  EXPECT_EQ(out.str(), run("tmp.txt"));
+
+  uint64_t body = 0;
+  for (size_t i = 0; i < profile.counts.size(); ++i)
+    if (result.locations[i] >= 0 && line_at(int(i)) == 3) body += profile.counts[i];
+  EXPECT_EQ(body, 10 * 4); // lod s, lod i, add, str s per iteration
+  std::ostringstream report, folded;
+  profile.write_report(report, src, result.locations, result.instructions);
+  profile.write_folded(folded, src, result.locations, result.instructions);
+  EXPECT_NE(report.str().find("loop at line 2: 10 iterations"), std::string::npos);
+  EXPECT_NE(folded.str().find("program;loop@2;line 3 40\n"), std::string::npos);
+
+  std::istringstream bad_in{"x"};
+  EXPECT_THROW(execute(compile_program("read x").instructions, bad_in, out), std::runtime_error);
+  EXPECT_THROW(execute(compile_program("x := 0; write 1 / x").instructions, in, out), std::runtime_error);
+}
+
+TEST(profile_use, z) {
+  std::string src = R"(
+    hits := 0; s := 0;
+    for i := 0; i < 300; i := i + 1 do
+      if i % 10 != 0 then hits := hits + 1 else s := s + 1 end;
+      match i % 4 of case 0 => s := s + 2 case 1 => s := s - 1 case 3 => s := s + i end
+    end;
+    write hits; write s
+  )";
+  auto plain = compile_program(src);
+  ExecutionProfile first;
+  std::istringstream in;
+  std::ostringstream out;
+  execute(plain.instructions, in, out, &first);
+
+  std::stringstream file;
+  write_counts(file, src, statement_counts(plain, first));
+  auto counts = read_counts(file, src);
+  auto tuned = compile_program(src, {.profile = &counts});
+  EXPECT_NE(tuned.code, plain.code);
+
+  ExecutionProfile second;
+  std::ostringstream tuned_out;
+  execute(tuned.instructions, in, tuned_out, &second);
+  EXPECT_EQ(tuned_out.str(), out.str());
+  write_file("tmp.txt", tuned.code);
+  EXPECT_EQ(run("tmp.txt"), out.str());
+  EXPECT_LT(second.total_count(), first.total_count());
+
+  std::stringstream other;
+  write_counts(other, src + " ", counts);
+  EXPECT_THROW(read_counts(other, src), std::runtime_error);
+}
+
+TEST(deep_nesting, z) {
+  int n = 100000;
+  std::string parens = "write " + std::string(n, '(') + "1 + 2" + std::string(n, ')') + " * 3";
+  EXPECT_EQ(output(compile_program(parens)), "9\n");
+  std::string sum = "x := 1";
+  for (int i = 0; i < 2 * n; ++i) sum += " + 1";
+  auto summed = compile_program(sum + "; write x");
+  EXPECT_EQ(output(summed), "200001\n");
+  std::string nots = "write ";
+  for (int i = 0; i < n + 1; ++i) nots += "not ";
+  nots += std::string(n, '(') + "1 > 2" + std::string(n, ')');
+  EXPECT_EQ(output(compile_program(nots)), "1\n");
+
+  std::string ifs = "x := 1;\n";
+  for (int i = 0; i < n - 1; ++i) ifs += "if x > 0 then\n";
+  ifs += "write x";
+  for (int i = 0; i < n - 1; ++i) ifs += "\nend";
+  EXPECT_EQ(output(compile_program(ifs)), "1\n");
+  auto deep = compile_program(ifs, {.max_depth = 50}).diagnostics;
+  ASSERT_EQ(deep.errors.size(), 1);
+  EXPECT_EQ(deep.errors[0].line, 52);
+  EXPECT_EQ(deep.errors[0].column, 1);
+  EXPECT_EQ(deep.errors[0].message, "Statements nested deeper than 50 levels.");
+  EXPECT_THROW(compile_streaming(ifs, "tmp_stream.txt", {.max_depth = 50}), CompileError);
+
+  // The stack follows the nesting, not the length: work starts on the
+  // calling thread and reruns with 8 times the levels each time it nests
+  // too deep. Streaming and incremental compiles rerun just that statement.
+  std::vector<size_t> stacks;
+  int rewinds = 0;
+  run_nested(100000, [&] { ++rewinds; }, [&](size_t bytes) {
+    stacks.push_back(bytes);
+    if (global_stack_levels < 1000) throw StackLimit{};
+  });
+  EXPECT_EQ(stacks, (std::vector<size_t>{0, 512 * stack_per_level + (1 << 20), 4096 * stack_per_level + (1 << 20)}));
+  EXPECT_EQ(rewinds, 2);
+  std::string nested = "x := 1";
+  for (int i = 0; i < 1000; ++i) nested = "if x >= 0 then " + nested + "; x := x + 1 end";
+  nested = "x := 0; " + nested + "; write x";
+  auto expected = output(compile_program(nested));
+  EXPECT_EQ(expected, "1001\n");
+  compile_streaming(nested, "tmp_stream.txt");
+  EXPECT_EQ(run("tmp_stream.txt"), expected);
+  std::remove("tmp_stream.txt");
+  IncrementalCompiler incremental(nested);
+  incremental.edit(nested.size() - 1, 1, "x + 1");
+  write_file("tmp.txt", incremental.code());
+  EXPECT_EQ(run("tmp.txt"), "1002\n");
+
+  EXPECT_TRUE(compile_program("write ((1 + 2) * 3").diagnostics);
+  EXPECT_TRUE(compile_program("write (1 + )").diagnostics);
+}
+
+TEST(common_subexpressions, z) {
+  Ast ast;
+  int a = global_symbols.intern("a"), b = global_symbols.intern("b");
+  auto ab = ast.binary(ast.identifier(a), BinOp::mul, ast.identifier(b));
+  auto ab2 = ast.binary(ast.identifier(a), BinOp::mul, ast.identifier(b));
+  auto inc = ast.unary(UnOp::inc, ast.identifier(a));
+  EXPECT_EQ(ast.canon(ab2), ab);
+  EXPECT_NE(ast.canon(ast.binary(ast.identifier(b), BinOp::mul, ast.identifier(a))), ab);
+  EXPECT_EQ(ast.canon(inc), -1);
+  EXPECT_EQ(ast.canon(ast.binary(ab, BinOp::add, inc)), -1);
+
+  auto count = [](const std::string& code, std::string_view insn) {
+    int n = 0;
+    for (size_t at = code.find(insn); at != std::string::npos; at = code.find(insn, at + 1)) ++n;
+    return n;
+  };
+  // Reused across statements, and as both operands of one operator.
+  std::string src = "i := 7; j := 3; x := i % j * (i % j); y := i % j + j * j + (j * j); write x + y";
+  auto code = compile(src);
+  EXPECT_EQ(count(code, "mod"), 1);
+  EXPECT_EQ(count(code, "mul"), 2);
+  write_file("tmp.txt", code);
+  EXPECT_EQ(run("tmp.txt"), "20\n");
+
+  // Assignments, ++ and read invalidate; control flow ends the block.
+  src = "i := 8; j := 3; x := i % j; i := 9; y := i % j; z := i % j + ++i + (i % j); read j; write i % j;"
+        "if i % j > 0 then write x + y + z end";
+  code = compile(src);
+  EXPECT_EQ(count(code, "mod"), 5); // z reuses y's i % j
+  write_file("tmp.txt", code);
+  EXPECT_EQ(exec("echo 4 | ./Pmachine tmp.txt").substr(0, 5), "2\n13\n");
+}
+
+TEST(loop_unrolling, z) {
+  // Known trip count: no test left.
+  auto full = compile_program("s := 0; for i := 0; i < 10; i := i + 1 do s := s + i end; write s; write i");
+  EXPECT_EQ(full.code.find("jp"), std::string::npos);
+  EXPECT_EQ(output(full), "45\n10\n");
+  EXPECT_EQ(output(compile_program("for i := 2; i <= 1; i := i + 3 do write i end; write i")), "2\n");
+
+  // Invariant bound, continue and break, both directions.
+  for (std::string src: {
+    "n := 103; s := 0; for i := 1; n >= i; i := i + 2 do if i % 7 == 0 then continue end;"
+    " if i > 90 then break end; s := s + i end; write s; write i",
+    "n := 0 - 50; s := 0; for i := 60; i > n * 2; i := i - 7 do if i % 5 == 0 then continue end; s := s + i end;"
+    " write s; write i",
+  }) {
+    auto rolled = compile_program(src, {.unroll = 1});
+    ExecutionProfile before, after;
+    for (int unroll: {2, 3, 4}) {
+      auto unrolled = compile_program(src, {.unroll = unroll});
+      EXPECT_EQ(output(unrolled, &after), output(rolled, &before));
+      EXPECT_LT(after.total_count(), before.total_count());
+      write_file("tmp.txt", unrolled.code);
+      EXPECT_EQ(run("tmp.txt"), output(rolled));
+    }
+  }
+
+  // Loops that assign i or the bound stay rolled, as do loops a profile
+  // shows were never entered.
+  for (std::string src: {
+    "for i := 0; i < 10; i := i + 1 do i := i + 1; write i end",
+    "n := 10; for i := 0; i < n; i := i + 1 do n := n - 1 end",
+    "n := 0; s := 0; if n > 0 then for i := 0; i < n; i := i + 1 do s := s + i end end; write s",
+  }) {
+    auto plain = compile_program(src);
+    ExecutionProfile profile;
+    output(plain, &profile);
+    auto counts = statement_counts(plain, profile);
+    EXPECT_EQ(compile_program(src, {.profile = &counts}).code, compile_program(src, {.profile = &counts, .unroll = 1}).code);
+  }
+}
+
+TEST(superinstructions, z) {
+  for (auto& src: engine_programs) {
+    expect_like_pmachine(src, "9", {}, [](const CompileResult& compiled, std::istream& in, std::ostream& out) {
+      FusedProgram program(compiled.instructions);
+      EXPECT_LT(program.size(), compiled.instructions.size());
+      uint64_t dispatches = 0;
+      program.run(in, out, &dispatches);
+      return dispatches;
+    });
+  }
+  FusedProgram divide(compile_program("n := 7; read x; write x; write x / (n - 7)").instructions);
+  std::istringstream divide_in{"9"};
+  std::ostringstream divide_out;
+  EXPECT_THROW(divide.run(divide_in, divide_out), std::runtime_error);
+  EXPECT_EQ(divide_out.str(), "9\n");
+
+  // A jump that leaves the stack deeper on one path than the other: runs
+  // unfused, as before.
+  std::vector<Insn> code{{Op::ldc_i, 1}, {Op::fjp, 3}, {Op::ldc_i, 2}, {Op::out_i}, {Op::hlt}};
+  FusedProgram program(code);
+  EXPECT_EQ(program.size(), code.size());
+  std::istringstream in;
+  std::ostringstream out;
+  program.run(in, out);
+  EXPECT_EQ(out.str(), "2");
+}
+
+TEST(batch_runner, z) {
+  auto compiled = compile_program("read n; s := 0; for i := 1; i <= n; i := i + 1 do s := s + i end; write s");
+  FusedProgram program(compiled.instructions);
+  std::vector<std::string> inputs;
+  for (int n = 0; n < 300; ++n) inputs.push_back(std::to_string(n));
+  inputs[7] = "x";
+  inputs[9] = "100000000";
+  size_t next = 0;
+  run_batch(program, inputs.size(), [&](size_t i) { return inputs[i]; }, {.jobs = 4, .max_steps = 100000},
+            [&](size_t i, BatchRun& run) {
+    EXPECT_EQ(i, next++);
+    if (i == 7) {
+      EXPECT_EQ(run.error, "Cannot read an integer from the input.");
+    } else if (i == 9) {
+      EXPECT_EQ(run.error, "Step limit of 100000 instructions reached.");
+      EXPECT_EQ(run.output, "");
+    } else {
+      EXPECT_EQ(run.error, "");
+      EXPECT_EQ(run.output, std::to_string(i * (i + 1) / 2) + "\n");
+    }
+  });
+  EXPECT_EQ(next, inputs.size());
+
+  // A division that would trap fails its own run only.
+  FusedProgram divide(compile_program("read x; read y; write x / y; write x % y").instructions);
+  std::vector<std::string> pairs{"10 3", "-2147483648 -1", "-2147483648 1", "9 0"};
+  std::vector<BatchRun> runs;
+  run_batch(divide, pairs.size(), [&](size_t i) { return pairs[i]; }, {.jobs = 2},
+            [&](size_t, BatchRun& run) { runs.push_back(run); });
+  ASSERT_EQ(runs.size(), 4);
+  EXPECT_EQ(runs[0].output, "3\n1\n");
+  EXPECT_EQ(runs[1].error, "Division overflow.");
+  EXPECT_EQ(runs[2].output, "-2147483648\n0\n");
+  EXPECT_EQ(runs[3].error, "Division by zero.");
+
+  // What input() throws is its run's error; what done() throws stops the batch.
+  auto input = [](size_t i) -> std::string {
+    if (i == 3) throw std::runtime_error("No input.");
+    return "1";
+  };
+  EXPECT_THROW(run_batch(program, 1000, input, {.jobs = 2}, [](size_t i, BatchRun& run) {
+    if (i < 3) {
+      EXPECT_EQ(run.output, "1\n");
+    } else if (i == 3) {
+      EXPECT_EQ(run.error, "No input.");
+      throw std::logic_error("stop");
+    }
+  }), std::logic_error);
+  std::vector<std::string> errors;
+  run_batch(program, 3, [](size_t i) -> std::string {
+    if (i == 1) throw 1;
+    return "1";
+  }, {.jobs = 2}, [&](size_t, BatchRun& run) { errors.push_back(run.error); });
+  EXPECT_EQ(errors, (std::vector<std::string>{"", "Unknown exception.", ""}));
+}
+
+TEST(register_backend, z) {
+  auto programs = engine_programs;
+  programs.insert(programs.end(), {
+    "x := 5; write x + ++x; write ++x + x; write (++x) * (--x); y := x - ++x; write y; write x",
+    "x := 3; match x of case 3 => x := 4 case 4 => write 44 end; write x;"
+    " if odd x then write 1 end; if odd 7 then write 7 end",
+    "i := 0; do i := i + 1; if i == 3 then continue end; write i while not (i >= 5 or i == 100)",
+    "x := 1; repeat x := x * 3 until x > 50 xor x == 0; write x; exit; write 0",
+  });
+  for (auto& src: programs) {
+    expect_like_pmachine(src, "9", {.registers = true},
+                         [](const CompileResult& compiled, std::istream& in, std::ostream& out) {
+      uint64_t dispatches = 0;
+      compiled.registers->run(in, out, &dispatches);
+      return dispatches;
+    });
+  }
+  auto divide = compile_program("n := 7; read x; write x; write x / (n - 7)", {.registers = true});
+  std::istringstream divide_in{"9"};
+  std::ostringstream divide_out;
+  EXPECT_THROW(divide.registers->run(divide_in, divide_out), std::runtime_error);
+  EXPECT_EQ(divide_out.str(), "9\n");
+
+  // Operands are registers: an update is one instruction, and an
+  // arithmetic loop dispatches well under half the P-code instructions.
+  auto compiled = compile_program("x := 1; y := 2; x := x + y", {.registers = true});
+  EXPECT_EQ(compiled.registers->size(), 4);
+  EXPECT_NE(compiled.registers->disassemble().find("add r0 r0 r1"), std::string::npos);
+  compiled = compile_program("s := 0; for i := 0; i < 1000; i := i + 1 do s := s + i * i - s / 7 end; write s",
+                             {.unroll = 1, .registers = true});
+  ExecutionProfile profile;
+  auto expected = output(compiled, &profile);
+  std::istringstream in;
+  std::ostringstream reg_out;
+  uint64_t dispatches = 0;
+  compiled.registers->run(in, reg_out, &dispatches);
+  EXPECT_EQ(reg_out.str(), expected);
+  EXPECT_LT(2 * dispatches, profile.total_count());
+
+  // Divisions that would trap fail the same way on both engines.
+  compiled = compile_program("read x; read y; read z; write x / y; write x % z", {.registers = true});
+  FusedProgram fused(compiled.instructions);
+  for (std::string input: {"-2147483648 -1 1", "-2147483648 1 -1", "5 0 1", "5 1 0"}) {
+    auto error_of = [&](auto run) {
+      std::istringstream in{input};
+      std::ostringstream out;
+      try {
+        run(in, out);
+      } catch (const std::runtime_error& e) {
+        return std::string(e.what());
+      }
+      return std::string();
+    };
+    auto reg_error = error_of([&](auto& in, auto& out) { compiled.registers->run(in, out); });
+    EXPECT_EQ(reg_error, error_of([&](auto& in, auto& out) { fused.run(in, out); })) << input;
+    EXPECT_EQ(reg_error, input[1] == '2' ? "Division overflow." : "Division by zero.") << input;
+  }
+}
+
+TEST(diagnostics, z) {
+  auto result = compile_program("x := 1;\nwr ite 2;\nwrite x;\n  y := ;\nwrite 3");
+  auto& errors = result.diagnostics.errors;
+  ASSERT_EQ(errors.size(), 2);
+  EXPECT_EQ(errors[0].line, 2);
+  EXPECT_EQ(errors[0].column, 4);
+  EXPECT_EQ(errors[0].message, "Unexpected \"ite\".");
+  EXPECT_EQ(errors[1].line, 4);
+  EXPECT_EQ(errors[1].column, 8);
+  EXPECT_EQ(errors[1].message, "Unexpected \";\".");
+  EXPECT_FALSE(result.diagnostics.truncated);
+  EXPECT_TRUE(result.code.empty());
+
+  // Recovery stops at `end`, so the if around a bad statement still parses,
+  // and not inside comments.
+  std::string src = "if 1 then wr ite 1 else write 2 end; wr ite /* ; end */ 1; write 4";
+  result = compile_program(src);
+  ASSERT_EQ(errors.size(), 2);
+  EXPECT_EQ(errors[0].offset, 13);
+  EXPECT_EQ(errors[1].offset, src.find("ite /*"));
+
+  // A stray `end` is one error, at the `end`, along with the `;` after it.
+  result = compile_program("if 1 > 0 then write 1 end end; write 2");
+  ASSERT_EQ(errors.size(), 1);
+  EXPECT_EQ(errors[0].column, 27);
+  EXPECT_EQ(errors[0].message, "Unexpected \"end\".");
+  result = compile_program("x := 1; end; y := 2");
+  ASSERT_EQ(errors.size(), 1);
+  EXPECT_EQ(errors[0].column, 9);
+
+  // Parsing stops at the first error past the cap.
+  std::string bad;
+  for (int i = 0; i < 3; ++i) bad += "write 1;\nwrite ;\n";
+  result = compile_program(bad + "write 2");
+  EXPECT_EQ(errors.size(), 3);
+  EXPECT_FALSE(result.diagnostics.truncated);
+  for (int i = 3; i < 10; ++i) bad += "write 1;\nwrite ;\n";
+  bad += "write 2";
+  result = compile_program(bad);
+  EXPECT_EQ(errors.size(), 3);
+  EXPECT_TRUE(result.diagnostics.truncated);
+  result = compile_program(bad, {.max_errors = 0});
+  EXPECT_EQ(errors.size(), 10);
+  EXPECT_EQ(errors.back().line, 20);
+  EXPECT_FALSE(result.diagnostics.truncated);
+  std::ostringstream os;
+  write_diagnostics(os, bad, result.diagnostics);
+  EXPECT_TRUE(os.str().starts_with("Compiler Error at Line 2: Unexpected \";\".\nwrite ;\n      ^\n"));
+
+  try {
+    compile("write 1; write )");
+    ADD_FAILURE();
+  } catch (const CompileError& e) {
+    EXPECT_EQ(e.diagnostics.errors.size(), 1);
+  }
+}
@@ -0,0 +1,39 @@
+#include "thread.h"
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+StackThread::StackThread(size_t stack_bytes, std::function<void()> f): f(std::move(f)) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (stack_bytes) pthread_attr_setstacksize(&attr, stack_bytes);
+  int err = pthread_create(&id, &attr, start, this);
+  pthread_attr_destroy(&attr);
+  if (err) throw std::system_error(err, std::generic_category(), "Cannot start a compiler thread");
+  joinable = true;
+}
+
+StackThread::~StackThread() {
+  if (joinable) pthread_join(id, nullptr);
+}
+
+void* StackThread::start(void* self) {
+  auto t = static_cast<StackThread*>(self);
+  try {
+    t->f();
+  } catch (...) {
+    t->error = std::current_exception();
+  }
+  return nullptr;
+}
+
+void StackThread::join() {
+  if (joinable) pthread_join(id, nullptr);
+  joinable = false;
+  if (error) std::rethrow_exception(std::exchange(error, nullptr));
+}
+
+void run_with_stack(size_t stack_bytes, const std::function<void()>& f) {
+  if (!stack_bytes) return f();
+  StackThread(stack_bytes, f).join();
+}
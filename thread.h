@@ -0,0 +1,32 @@
+#ifndef ZPC_THREAD_H
+#define ZPC_THREAD_H
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <pthread.h>
+
+// A thread with a stack of `stack_bytes`, or the system default if 0, for
+// work that recurses once per level of statement nesting. join() waits for
+// it and rethrows whatever `f` threw; the destructor joins too.
+class StackThread {
+public:
+  StackThread(size_t stack_bytes, std::function<void()> f);
+  ~StackThread();
+  StackThread(const StackThread&) = delete;
+  StackThread& operator = (const StackThread&) = delete;
+
+  void join();
+private:
+  static void* start(void* self);
+
+  std::function<void()> f;
+  std::exception_ptr error;
+  pthread_t id;
+  bool joinable = false;
+};
+
+// Runs `f` on a StackThread of `stack_bytes` and waits for it; in place if
+// `stack_bytes` is 0.
+void run_with_stack(size_t stack_bytes, const std::function<void()>& f);
+
+#endif //ZPC_THREAD_H
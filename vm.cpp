@@ -0,0 +1,393 @@
+#include "vm.h"
+#include "io.h"
+#include <fmt/format.h>
+#include <algorithm>
+#include <chrono>
+#include <istream>
+#include <limits>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+
+namespace {
+  std::runtime_error step_limit(uint64_t max_steps) {
+    return std::runtime_error(fmt::format("Step limit of {} instructions reached.", max_steps));
+  }
+
+  // Throws where a / b and a % b are undefined.
+  void check_division(int a, int b) {
+    if (b == 0) throw std::runtime_error("Division by zero.");
+    if (b == -1 && a == std::numeric_limits<int>::min()) throw std::runtime_error("Division overflow.");
+  }
+
+  template<bool profiled>
+  void run(std::span<const Insn> code, std::istream& in, std::ostream& out, ExecutionProfile* profile,
+           uint64_t max_steps = 0) {
+    using clock = std::chrono::steady_clock;
+    std::vector<int> st;
+    auto pop = [&] {
+      int v = st.back();
+      st.pop_back();
+      return v;
+    };
+    auto binary = [&](auto f) {
+      int b = pop();
+      st.back() = f(st.back(), b);
+    };
+    auto divisor = [&] {
+      int b = pop();
+      check_division(st.back(), b);
+      return b;
+    };
+
+    uint64_t steps = 0;
+    for (size_t pc = 0; pc < code.size();) {
+      if (max_steps && ++steps > max_steps) throw step_limit(max_steps);
+      size_t at = pc++;
+      auto start = profiled ? clock::now() : clock::time_point{};
+      auto& insn = code[at];
+      switch (insn.op) {
+        case Op::ssp: st.resize(insn.arg); break;
+        case Op::ldc_i: case Op::ldc_c: st.push_back(insn.arg); break;
+        case Op::lod: st.push_back(st[insn.arg]); break;
+        case Op::str: st[insn.arg] = pop(); break;
+        case Op::add: binary([](int a, int b) { return int(unsigned(a) + unsigned(b)); }); break;
+        case Op::sub: binary([](int a, int b) { return int(unsigned(a) - unsigned(b)); }); break;
+        case Op::mul: binary([](int a, int b) { return int(unsigned(a) * unsigned(b)); }); break;
+        case Op::div: { int b = divisor(); st.back() /= b; break; }
+        case Op::mod: { int b = divisor(); st.back() %= b; break; }
+        case Op::grt: binary([](int a, int b) { return int(a > b); }); break;
+        case Op::les: binary([](int a, int b) { return int(a < b); }); break;
+        case Op::geq: binary([](int a, int b) { return int(a >= b); }); break;
+        case Op::leq: binary([](int a, int b) { return int(a <= b); }); break;
+        case Op::equ: binary([](int a, int b) { return int(a == b); }); break;
+        case Op::neq: binary([](int a, int b) { return int(a != b); }); break;
+        case Op::and_: binary([](int a, int b) { return int(a && b); }); break;
+        case Op::or_: binary([](int a, int b) { return int(a || b); }); break;
+        case Op::xor_: binary([](int a, int b) { return int(bool(a) != bool(b)); }); break;
+        case Op::not_: st.back() = !st.back(); break;
+        case Op::dpl: st.push_back(st.back()); break;
+        case Op::pop: st.pop_back(); break;
+        case Op::fjp: if (!pop()) pc = insn.arg; break;
+        case Op::ujp: pc = insn.arg; break;
+        case Op::in: {
+          int v;
+          if (!(in >> v)) throw std::runtime_error("Cannot read an integer from the input.");
+          st.push_back(v);
+          break;
+        }
+        case Op::out_i: out << pop(); break;
+        case Op::out_c: out << char(pop()); break;
+        case Op::hlt: pc = code.size(); break;
+      }
+      if constexpr (profiled) {
+        ++profile->counts[at];
+        profile->ns[at] += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+      }
+    }
+  }
+
+  bool is_binary(Op op) { return op >= Op::add && op <= Op::xor_; }
+
+  int apply(Op op, int a, int b) {
+    switch (op) {
+      case Op::add: return int(unsigned(a) + unsigned(b));
+      case Op::sub: return int(unsigned(a) - unsigned(b));
+      case Op::mul: return int(unsigned(a) * unsigned(b));
+      case Op::div: case Op::mod:
+        check_division(a, b);
+        return op == Op::div ? a / b : a % b;
+      case Op::grt: return a > b;
+      case Op::les: return a < b;
+      case Op::geq: return a >= b;
+      case Op::leq: return a <= b;
+      case Op::equ: return a == b;
+      case Op::neq: return a != b;
+      case Op::and_: return a && b;
+      case Op::or_: return a || b;
+      case Op::xor_: return bool(a) != bool(b);
+      default: return 0;
+    }
+  }
+
+  // Operand stack depth before every instruction, or empty when it is not
+  // the same along every path, an instruction pops more than there is, or a
+  // slot lies outside the frame. -1 for unreachable instructions.
+  std::vector<int> stack_depths(std::span<const Insn> code, int frame) {
+    int size = static_cast<int>(code.size());
+    std::vector<int> depths(size, -1);
+    std::vector<int> todo;
+    auto reach = [&](int at, int depth) {
+      if (at < 0 || at >= size) return true; // runs off the end
+      if (depths[at] < 0) depths[at] = depth, todo.push_back(at);
+      return depths[at] == depth;
+    };
+    if (size && !reach(0, 0)) return {};
+    while (!todo.empty()) {
+      int at = todo.back();
+      todo.pop_back();
+      auto [op, arg] = code[at];
+      int depth = depths[at], pops = 0, pushes = 0;
+      switch (op) {
+        case Op::ssp: if (at != 0) return {}; break;
+        case Op::ldc_i: case Op::ldc_c: case Op::in: pushes = 1; break;
+        case Op::lod: if (arg < 0 || arg >= frame) return {}; pushes = 1; break;
+        case Op::str: if (arg < 0 || arg >= frame) return {}; pops = 1; break;
+        case Op::not_: pops = pushes = 1; break;
+        case Op::dpl: pops = 1, pushes = 2; break;
+        case Op::pop: case Op::fjp: case Op::out_i: case Op::out_c: pops = 1; break;
+        case Op::ujp: case Op::hlt: break;
+        default: pops = 2, pushes = 1; break; // binary operators
+      }
+      if (depth < pops) return {};
+      depth += pushes - pops;
+      bool ok = true;
+      if (op == Op::fjp || op == Op::ujp) ok = reach(arg, depth);
+      if (op != Op::ujp && op != Op::hlt) ok = reach(at + 1, depth) && ok;
+      if (!ok) return {};
+    }
+    return depths;
+  }
+
+  // Address ranges [begin, end] of loops: every backward jump closes one.
+  struct Loop {
+    int begin, end;
+  };
+
+  std::vector<Loop> find_loops(std::span<const Insn> code) {
+    std::vector<Loop> loops;
+    for (int i = 0; i < static_cast<int>(code.size()); ++i)
+      if ((code[i].op == Op::ujp || code[i].op == Op::fjp) && code[i].arg <= i) loops.push_back({code[i].arg, i});
+    std::sort(loops.begin(), loops.end(), [](Loop a, Loop b) {
+      return a.begin != b.begin ? a.begin < b.begin : a.end > b.end;
+    });
+    return loops;
+  }
+}
+
+FusedProgram::FusedProgram(std::span<const Insn> insns) {
+  int size = static_cast<int>(insns.size());
+  frame = size && insns[0].op == Op::ssp ? insns[0].arg : 0;
+  auto depths = stack_depths(insns, frame);
+  if (size && depths.empty()) {
+    unfused.assign(insns.begin(), insns.end());
+    return;
+  }
+  fused = true;
+  for (int d: depths) depth = std::max(depth, d + 1); // after pushing one
+
+  std::vector<bool> target(size + 1);
+  for (auto [op, arg]: insns)
+    if ((op == Op::fjp || op == Op::ujp) && arg >= 0 && arg < size) target[arg] = true;
+  // Whether insns[at ..] starts with `ops`, none of them but the first a
+  // jump target. ssp, which only ever leads the code, stands for any binary
+  // operator.
+  constexpr Op any = Op::ssp;
+  auto starts = [&](int at, std::initializer_list<Op> ops) {
+    if (size - at < int(ops.size())) return false;
+    for (int k = 0; k < int(ops.size()); ++k) {
+      Op want = ops.begin()[k], op = insns[at + k].op;
+      if (want == any ? !is_binary(op) : op != want) return false;
+      if (k > 0 && target[at + k]) return false;
+    }
+    return true;
+  };
+
+  std::vector<int> address(size + 1); // old address -> index in code
+  for (int at = int(size && insns[0].op == Op::ssp); at < size;) {
+    address[at] = int(code.size());
+    auto& i = insns[at];
+    int len = 1;
+    Fused f{Kind::hlt};
+    if (starts(at, {Op::lod, Op::lod, any, Op::fjp})) {
+      f = {Kind::lod_lod_op_fjp, insns[at + 2].op, i.arg, insns[at + 1].arg, insns[at + 3].arg}, len = 4;
+    } else if (starts(at, {Op::lod, Op::ldc_i, any, Op::fjp})) {
+      f = {Kind::lod_ldc_op_fjp, insns[at + 2].op, i.arg, insns[at + 1].arg, insns[at + 3].arg}, len = 4;
+    } else if (starts(at, {Op::lod, Op::lod, any, Op::str})) {
+      f = {Kind::lod_lod_op_str, insns[at + 2].op, i.arg, insns[at + 1].arg, insns[at + 3].arg}, len = 4;
+    } else if (starts(at, {Op::lod, Op::ldc_i, any, Op::str})) {
+      f = {Kind::lod_ldc_op_str, insns[at + 2].op, i.arg, insns[at + 1].arg, insns[at + 3].arg}, len = 4;
+    } else if (starts(at, {Op::dpl, Op::ldc_i, Op::equ, Op::fjp})) {
+      f = {Kind::case_fjp, Op::equ, 0, insns[at + 1].arg, insns[at + 3].arg}, len = 4;
+    } else if (starts(at, {Op::lod, Op::lod, any})) {
+      f = {Kind::lod_lod_op, insns[at + 2].op, i.arg, insns[at + 1].arg}, len = 3;
+    } else if (starts(at, {Op::lod, Op::ldc_i, any})) {
+      f = {Kind::lod_ldc_op, insns[at + 2].op, i.arg, insns[at + 1].arg}, len = 3;
+    } else if (starts(at, {Op::out_i, Op::ldc_c, Op::out_c})) {
+      f = {Kind::out_i_c, Op::add, 0, insns[at + 1].arg}, len = 3;
+    } else if (starts(at, {any, Op::fjp})) {
+      f = {Kind::op_fjp, i.op, 0, 0, insns[at + 1].arg}, len = 2;
+    } else if (starts(at, {any, Op::str})) {
+      f = {Kind::op_str, i.op, 0, 0, insns[at + 1].arg}, len = 2;
+    } else if (starts(at, {Op::lod, any})) {
+      f = {Kind::lod_op, insns[at + 1].op, i.arg}, len = 2;
+    } else if (starts(at, {Op::ldc_i, any}) || starts(at, {Op::ldc_c, any})) {
+      f = {Kind::ldc_op, insns[at + 1].op, 0, i.arg}, len = 2;
+    } else if (starts(at, {Op::ldc_i, Op::str}) || starts(at, {Op::ldc_c, Op::str})) {
+      f = {Kind::ldc_str, Op::add, 0, i.arg, insns[at + 1].arg}, len = 2;
+    } else if (starts(at, {Op::lod, Op::str})) {
+      f = {Kind::lod_str, Op::add, i.arg, 0, insns[at + 1].arg}, len = 2;
+    } else {
+      switch (i.op) {
+        case Op::ldc_i: case Op::ldc_c: f = {Kind::ldc, Op::add, 0, i.arg}; break;
+        case Op::lod: f = {Kind::lod, Op::add, i.arg}; break;
+        case Op::str: f = {Kind::str, Op::add, 0, 0, i.arg}; break;
+        case Op::not_: f = {Kind::not_}; break;
+        case Op::dpl: f = {Kind::dpl}; break;
+        case Op::pop: f = {Kind::pop}; break;
+        case Op::fjp: f = {Kind::fjp, Op::add, 0, 0, i.arg}; break;
+        case Op::ujp: f = {Kind::ujp, Op::add, 0, 0, i.arg}; break;
+        case Op::in: f = {Kind::in}; break;
+        case Op::out_i: f = {Kind::out_i}; break;
+        case Op::out_c: f = {Kind::out_c}; break;
+        case Op::ssp: case Op::hlt: f = {Kind::hlt}; break; // ssp only leads
+        default: f = {Kind::binary, i.op}; break;
+      }
+    }
+    for (int k = 1; k < len; ++k) address[at + k] = int(code.size());
+    f.len = uint8_t(len);
+    code.push_back(f);
+    at += len;
+  }
+  address[size] = int(code.size());
+  for (auto& f: code) {
+    bool jumps = f.kind == Kind::fjp || f.kind == Kind::ujp || f.kind == Kind::op_fjp || f.kind == Kind::case_fjp ||
+                 f.kind == Kind::lod_lod_op_fjp || f.kind == Kind::lod_ldc_op_fjp;
+    if (jumps) f.c = f.c >= 0 && f.c < size ? address[f.c] : int(code.size());
+  }
+}
+
+template<bool counted>
+void FusedProgram::run_fused(std::istream& in, std::ostream& out, uint64_t* dispatches, uint64_t max_steps) const {
+  std::vector<int> slots(frame), stack(depth + 1);
+  int* v = slots.data();
+  int* sp = stack.data(); // the operand stack below tos; stack[0] is never read
+  int tos = 0;
+  auto push = [&](int x) {
+    *++sp = tos;
+    tos = x;
+  };
+  auto pop = [&] {
+    int x = tos;
+    tos = *sp--;
+    return x;
+  };
+  uint64_t n = 0, steps = 0;
+  size_t size = code.size();
+  for (size_t pc = 0; pc < size;) {
+    auto& f = code[pc++];
+    if constexpr (counted) {
+      ++n;
+      if (max_steps && (steps += f.len) > max_steps) throw step_limit(max_steps);
+    }
+    switch (f.kind) {
+      case Kind::ldc: push(f.b); break;
+      case Kind::lod: push(v[f.a]); break;
+      case Kind::str: v[f.c] = pop(); break;
+      case Kind::binary: { int b = pop(); tos = apply(f.op, tos, b); break; }
+      case Kind::not_: tos = !tos; break;
+      case Kind::dpl: push(tos); break;
+      case Kind::pop: pop(); break;
+      case Kind::fjp: if (!pop()) pc = f.c; break;
+      case Kind::ujp: pc = f.c; break;
+      case Kind::in: {
+        int x;
+        if (!(in >> x)) throw std::runtime_error("Cannot read an integer from the input.");
+        push(x);
+        break;
+      }
+      case Kind::out_i: out << pop(); break;
+      case Kind::out_c: out << char(pop()); break;
+      case Kind::hlt: pc = size; break;
+      case Kind::lod_lod_op: push(apply(f.op, v[f.a], v[f.b])); break;
+      case Kind::lod_ldc_op: push(apply(f.op, v[f.a], f.b)); break;
+      case Kind::lod_op: tos = apply(f.op, tos, v[f.a]); break;
+      case Kind::ldc_op: tos = apply(f.op, tos, f.b); break;
+      case Kind::lod_lod_op_fjp: if (!apply(f.op, v[f.a], v[f.b])) pc = f.c; break;
+      case Kind::lod_ldc_op_fjp: if (!apply(f.op, v[f.a], f.b)) pc = f.c; break;
+      case Kind::op_fjp: { int b = pop(), a = pop(); if (!apply(f.op, a, b)) pc = f.c; break; }
+      case Kind::lod_lod_op_str: v[f.c] = apply(f.op, v[f.a], v[f.b]); break;
+      case Kind::lod_ldc_op_str: v[f.c] = apply(f.op, v[f.a], f.b); break;
+      case Kind::op_str: { int b = pop(), a = pop(); v[f.c] = apply(f.op, a, b); break; }
+      case Kind::ldc_str: v[f.c] = f.b; break;
+      case Kind::lod_str: v[f.c] = v[f.a]; break;
+      case Kind::case_fjp: if (tos != f.b) pc = f.c; break;
+      case Kind::out_i_c: out << pop() << char(f.b); break;
+    }
+  }
+  if constexpr (counted) {
+    if (dispatches) *dispatches += n;
+  }
+}
+
+void FusedProgram::run(std::istream& in, std::ostream& out, uint64_t* dispatches, uint64_t max_steps) const {
+  if (fused) {
+    if (dispatches || max_steps) return run_fused<true>(in, out, dispatches, max_steps);
+    return run_fused<false>(in, out, nullptr, 0);
+  }
+  if (!dispatches) return ::run<false>(unfused, in, out, nullptr, max_steps);
+  ExecutionProfile profile;
+  profile.counts.assign(unfused.size(), 0);
+  profile.ns.assign(unfused.size(), 0);
+  ::run<true>(unfused, in, out, &profile, max_steps);
+  *dispatches += profile.total_count();
+}
+
+void execute(std::span<const Insn> code, std::istream& in, std::ostream& out, ExecutionProfile* profile) {
+  if (!profile) return FusedProgram(code).run(in, out);
+  profile->counts.assign(code.size(), 0);
+  profile->ns.assign(code.size(), 0);
+  run<true>(code, in, out, profile);
+}
+
+uint64_t ExecutionProfile::total_count() const {
+  uint64_t total = 0;
+  for (auto c: counts) total += c;
+  return total;
+}
+
+void ExecutionProfile::write_report(std::ostream& os, std::string_view source, std::span<const int> locations,
+                                    std::span<const Insn> code) const {
+  LineIndex lines(source);
+  std::vector<uint64_t> line_counts(lines.lines() + 1), line_ns(lines.lines() + 1);
+  uint64_t total_ns = 0;
+  for (size_t i = 0; i < counts.size(); ++i) {
+    int line = locations[i] < 0 ? 0 : lines.line(locations[i]);
+    line_counts[line] += counts[i];
+    line_ns[line] += ns[i];
+    total_ns += ns[i];
+  }
+  auto share = [&](uint64_t t) { return total_ns ? 100.0 * double(t) / double(total_ns) : 0.0; };
+
+  os << fmt::format("{:>6} {:>12} {:>10} {:>6}  source\n", "line", "count", "time ms", "%");
+  for (int line = 1; line <= lines.lines(); ++line)
+    os << fmt::format("{:>6} {:>12} {:>10.3f} {:>6.1f}  {}\n", line, line_counts[line], line_ns[line] / 1e6,
+                      share(line_ns[line]), lines.text(line));
+  os << fmt::format("{:>6} {:>12} {:>10.3f} {:>6.1f}  (no source)\n", "-", line_counts[0], line_ns[0] / 1e6,
+                    share(line_ns[0]));
+
+  for (auto [begin, end]: find_loops(code)) {
+    uint64_t count = 0, time = 0;
+    for (int i = begin; i <= end; ++i) count += counts[i], time += ns[i];
+    int line = locations[end] < 0 ? 0 : lines.line(locations[end]);
+    os << fmt::format("loop at line {}: {} iterations, {} instructions, {:.3f} ms ({:.1f}%)\n",
+                      line, counts[end], count, time / 1e6, share(time));
+  }
+}
+
+void ExecutionProfile::write_folded(std::ostream& os, std::string_view source, std::span<const int> locations,
+                                    std::span<const Insn> code) const {
+  LineIndex lines(source);
+  auto loops = find_loops(code);
+  auto line_of = [&](int at) { return locations[at] < 0 ? 0 : lines.line(locations[at]); };
+  std::map<std::string, uint64_t> stacks;
+  for (int i = 0; i < static_cast<int>(counts.size()); ++i) {
+    if (!counts[i]) continue;
+    std::string stack = "program";
+    for (auto [begin, end]: loops)
+      if (begin <= i && i <= end) stack += fmt::format(";loop@{}", line_of(end));
+    stack += locations[i] < 0 ? std::string(";(no source)") : fmt::format(";line {}", line_of(i));
+    stacks[stack] += counts[i];
+  }
+  for (auto& [stack, count]: stacks) os << stack << ' ' << count << '\n';
+}
@@ -0,0 +1,83 @@
+#ifndef ZPC_VM_H
+#define ZPC_VM_H
+#include <cstdint>
+#include <iosfwd>
+#include <span>
+#include <string_view>
+#include <vector>
+#include "assembler.h"
+
+// Per-instruction counters of an instrumented run.
+struct ExecutionProfile {
+  std::vector<uint64_t> counts; // executions, by address
+  std::vector<uint64_t> ns;     // time spent, by address
+
+  uint64_t total_count() const;
+
+  // `locations` gives the source offset of every instruction, -1 for none.
+  // The report lists every source line with its instruction count, time and
+  // share of the time, followed by one line per loop.
+  void write_report(std::ostream& os, std::string_view source, std::span<const int> locations,
+                    std::span<const Insn> code) const;
+  // Folded stacks for flame graphs: enclosing loops, outermost first, then
+  // the source line, weighted by executed instructions.
+  void write_folded(std::ostream& os, std::string_view source, std::span<const int> locations,
+                    std::span<const Insn> code) const;
+};
+
+// P-code prepared for execution. Runs of instructions codegen emits together
+// (`lod; ldc; add`, `lod; lod; les; fjp`, `dpl; ldc; equ; fjp`, `out; ldc;
+// out`, ...) are fused into superinstructions that dispatch once, and the top
+// of the operand stack is kept in a register, apart from the variables. The
+// fusion needs the operand stack depth at every address to be known at load
+// time; code where it is not, which codegen never emits, runs unfused.
+class FusedProgram {
+public:
+  explicit FusedProgram(std::span<const Insn> code);
+
+  // Same semantics as execute(). Adds the instructions dispatched to
+  // `dispatches`, if given. With `max_steps`, throws std::runtime_error
+  // instead of dispatching past that many P-code instructions. Runs share
+  // nothing but the code, so any number may go on at once.
+  void run(std::istream& in, std::ostream& out, uint64_t* dispatches = nullptr, uint64_t max_steps = 0) const;
+  // Instructions after fusion.
+  size_t size() const { return fused ? code.size() : unfused.size(); }
+
+private:
+  enum class Kind : uint8_t {
+    // one instruction
+    ldc, lod, str, binary, not_, dpl, pop, fjp, ujp, in, out_i, out_c, hlt,
+    // a op b, with a and b the slot or constant named
+    lod_lod_op, lod_ldc_op, lod_op, ldc_op,
+    lod_lod_op_fjp, lod_ldc_op_fjp, op_fjp,
+    lod_lod_op_str, lod_ldc_op_str, op_str,
+    ldc_str, lod_str,
+    case_fjp, // dpl; ldc; equ; fjp: the match arm test
+    out_i_c,  // out i; ldc c; out c
+  };
+  struct Fused {
+    Kind kind;
+    Op op = Op::add; // operator of binary and fused operations
+    int a = 0, b = 0;
+    int c = 0;       // jump target or slot stored to
+    uint8_t len = 1; // P-code instructions fused
+  };
+  template<bool counted>
+  void run_fused(std::istream& in, std::ostream& out, uint64_t* dispatches, uint64_t max_steps) const;
+
+  bool fused = false;
+  std::vector<Fused> code;
+  std::vector<Insn> unfused;
+  int frame = 0; // slots set up by the leading ssp
+  int depth = 0; // deepest the operand stack gets
+};
+
+// Runs P-code in process, with Pmachine's semantics for everything Assembler
+// emits. Booleans are the integers 0 and 1. `in i` reads integers from `in`.
+// Throws std::runtime_error on division by zero, on the minimum integer
+// divided by -1, or on unreadable input. With a profile, every instruction
+// is counted and timed; without, the code runs as a FusedProgram.
+void execute(std::span<const Insn> code, std::istream& in, std::ostream& out,
+             ExecutionProfile* profile = nullptr);
+
+#endif //ZPC_VM_H
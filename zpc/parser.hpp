@@ -3,9 +3,15 @@
 
 #include <string_view>
 #include <cassert>
+#include <cctype>
+#include <chrono>
 #include <functional>
 #include <string>
 #include <iostream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <fmt/format.h>
 
 #include "unique_variant.hpp"
 #include "optional.hpp"
@@ -30,6 +36,8 @@ public:
   using std::string_view::length;
   using std::string_view::empty;
   using std::string_view::operator[];
+  using std::string_view::find;
+  using std::string_view::npos;
   friend std::ostream& operator << (std::ostream& os, const Scanner& s);
 
   bool skip = true;
@@ -40,6 +48,100 @@ std::ostream& operator << (std::ostream& os, const Scanner& s) {
   return os << s.data();
 }
 
+// Skips whitespace, /* block */ and // line comments. An unterminated block
+// comment is left in place and marks the end of input as the furthest point.
+void skip_space(Scanner& in) {
+  while (!in.empty()) {
+    if (isspace(in[0])) {
+      in.remove_prefix(1);
+    } else if (in.starts_with("/*")) {
+      auto end = in.find("*/", 2);
+      if (end == Scanner::npos) {
+        in.furthest = 0;
+        break;
+      }
+      in.remove_prefix(end + 2);
+    } else if (in.starts_with("//")) {
+      in.remove_prefix(std::min(in.find('\n'), in.size()));
+    } else {
+      break;
+    }
+  }
+  in.furthest = std::min(in.furthest, in.size());
+}
+
+// Per-rule counters for named parsers, collected while `grammar_profiler` is set.
+class GrammarProfiler {
+public:
+  struct Rule {
+    uint64_t calls = 0, successes = 0, failures = 0;
+    uint64_t consumed = 0;  // bytes consumed by successful invocations
+    uint64_t rescanned = 0; // bytes given back by attempt() after a failure
+    double inclusive_ns = 0;
+    int active = 0;
+  };
+
+  void enter(const char* name, size_t remaining) {
+    ++rules[name].active;
+    path += path.empty() ? "" : ";";
+    path += name;
+    frames.push_back({name, remaining, path.size() - std::string_view(name).size(), clock::now(), 0});
+  }
+
+  void exit(size_t remaining, bool ok) {
+    auto f = frames.back();
+    frames.pop_back();
+    double ns = std::chrono::duration<double, std::nano>(clock::now() - f.start).count();
+    auto& r = rules[f.name];
+    ++r.calls;
+    if (ok) ++r.successes, r.consumed += f.remaining - remaining;
+    else ++r.failures;
+    if (--r.active == 0) r.inclusive_ns += ns; // count recursive rules once
+    folded[path] += ns - f.child_ns;
+    path.resize(f.path_begin ? f.path_begin - 1 : 0);
+    if (!frames.empty()) frames.back().child_ns += ns;
+  }
+
+  // `name` is the rule that failed, or nullptr to blame the innermost active rule.
+  void backtrack(const char* name, size_t bytes) {
+    if (!name && frames.empty()) return;
+    rules[name ? name : frames.back().name].rescanned += bytes;
+  }
+
+  const std::map<std::string_view, Rule>& stats() const { return rules; }
+
+  void write_table(std::ostream& os) const {
+    std::vector<std::pair<std::string_view, Rule>> v(rules.begin(), rules.end());
+    std::sort(v.begin(), v.end(), [](auto& a, auto& b) { return a.second.inclusive_ns > b.second.inclusive_ns; });
+    os << fmt::format("{:<16}{:>10}{:>10}{:>10}{:>12}{:>12}{:>12}\n",
+                      "rule", "calls", "ok", "fail", "consumed", "rescanned", "incl ms");
+    for (auto& [name, r]: v) {
+      os << fmt::format("{:<16}{:>10}{:>10}{:>10}{:>12}{:>12}{:>12.3f}\n",
+                        name, r.calls, r.successes, r.failures, r.consumed, r.rescanned, r.inclusive_ns / 1e6);
+    }
+  }
+
+  // One "rule;rule;rule self-ns" line per stack, as consumed by flamegraph.pl.
+  void write_folded(std::ostream& os) const {
+    for (auto& [stack, ns]: folded) os << stack << ' ' << static_cast<uint64_t>(ns) << '\n';
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+  struct Frame {
+    const char* name;
+    size_t remaining, path_begin;
+    clock::time_point start;
+    double child_ns;
+  };
+  std::map<std::string_view, Rule> rules;
+  std::map<std::string, double> folded;
+  std::vector<Frame> frames;
+  std::string path;
+};
+
+GrammarProfiler* grammar_profiler = nullptr;
+
 template<typename T>
 class Parser;
 
@@ -57,9 +159,19 @@ public:
     skip_ = false;
     return static_cast<Parser<T>&&>(*this);
   }
+
+  // Names the rule for the grammar profiler; `name` must outlive the parser.
+  Parser<T>&& named(const char* name) && {
+    name_ = name;
+    return static_cast<Parser<T>&&>(*this);
+  }
+  const char* name() const { return name_; }
 private:
+  ParseResult<T> parse(Scanner& in) const;
+
   std::function<ParseResult<T>(Scanner&)> p;
   bool skip_ = true;
+  const char* name_ = nullptr;
 };
 
 
@@ -94,46 +206,63 @@ Parser<std::tuple<>> seq() {
   };
 }
 
-template<typename T, typename... Ts, typename R = std::tuple<T, Ts...>>
-Parser<R> seq(const Parser<T>& p, const Parser<Ts>& ...ps) {
-  return [=](Scanner& in)->ParseResult<R> {
+// The combinators below run their parts through these functions rather than
+// by building parsers while parsing: a Parser copy is a deep copy of its
+// closure, and on a recursive rule it would be held for every level.
+namespace detail {
+  inline ParseResult<std::tuple<>> seq(Scanner&) {
+    return std::make_tuple();
+  }
+
+  template<typename T, typename... Ts>
+  ParseResult<std::tuple<T, Ts...>> seq(Scanner& in, const Parser<T>& p, const Parser<Ts>& ...ps) {
     return p(in).flat_map([&](auto v) {
-      return seq(ps...)(in).map([&](auto vs) {
+      return seq(in, ps...).map([&](auto vs) {
         return std::tuple_cat(std::make_tuple(v), vs);
       });
     });
-  };
-}
+  }
 
-template<typename T>
-Parser<T> attempt(const Parser<T>& p) {
-  return [=](Scanner& in)->ParseResult<T> {
+  template<typename T>
+  ParseResult<T> attempt(const Parser<T>& p, Scanner& in) {
     auto in_bak = in;
     auto v = p(in);
     if (!v) {
+      if (grammar_profiler) grammar_profiler->backtrack(p.name(), in_bak.size() - in.size());
       in_bak.furthest = std::min(in_bak.furthest, in.size());
       in = in_bak;
     }
     return v;
-  };
-}
+  }
 
-namespace detail {
   template<typename R>
-  Parser<R> alt() {
-    return [](Scanner&)->ParseResult<R> {
-      return {};
-    };
+  ParseResult<R> alt(Scanner&) {
+    return {};
   }
 
   template<typename R, typename T, typename... Ts>
-  Parser<R> alt(const Parser<T>& p, const Parser<Ts>& ...ps) {
-    return [=](Scanner& in)->ParseResult<R> {
-      auto res = attempt(p)(in).map([](auto v){ return R{v}; });
-      if (!res) res = alt<R>(ps...)(in);
-      return res;
-    };
+  ParseResult<R> alt(Scanner& in, const Parser<T>& p, const Parser<Ts>& ...ps) {
+    auto res = attempt(p, in).map([](auto v){ return R{v}; });
+    if (!res) res = alt<R>(in, ps...);
+    return res;
   }
+}
+
+template<typename T, typename... Ts, typename R = std::tuple<T, Ts...>>
+Parser<R> seq(const Parser<T>& p, const Parser<Ts>& ...ps) {
+  return [=](Scanner& in)->ParseResult<R> {
+    return detail::seq(in, p, ps...);
+  };
+}
+
+template<typename T>
+Parser<T> attempt(const Parser<T>& p) {
+  return [=](Scanner& in)->ParseResult<T> {
+    return detail::attempt(p, in);
+  };
+}
+
+namespace detail {
 
   template<typename... Ts>
   auto flat(const std::variant<Ts...>& v) {
@@ -147,7 +276,10 @@ namespace detail {
 
 template<typename... Ts>
 auto alt(const Parser<Ts>& ...ps) {
-  return detail::alt<unique_variant_t<Ts...>>(ps...) % RESOLVE_OVERLOAD(detail::flat);
+  using R = unique_variant_t<Ts...>;
+  return Parser<R>([=](Scanner& in)->ParseResult<R> {
+    return detail::alt<R>(in, ps...);
+  }) % RESOLVE_OVERLOAD(detail::flat);
 }
 
 template<typename T, typename R = std::vector<T>>
@@ -155,7 +287,7 @@ Parser<R> many(const Parser<T>& p) {
   return [=](Scanner& in)->ParseResult<R> {
     R r;
     ParseResult<T> v;
-    while ((v = attempt(p)(in))) {
+    while ((v = detail::attempt(p, in))) {
       r.emplace_back(v.value());
     }
     return r;
@@ -206,7 +338,8 @@ auto ch_range(char l, char r) {
 }
 
 
-template<typename T, typename R = std::string>
+// The matched text, as a view into the input.
+template<typename T, typename R = std::string_view>
 Parser<R> raw(const Parser<T>& p) {
   return [=](Scanner& in)->ParseResult<R> {
     auto in_bak = in;
@@ -218,9 +351,13 @@ Parser<R> raw(const Parser<T>& p) {
 template<typename T, typename R = std::vector<T>>
 Parser<R> many1(const Parser<T>& p) {
   return [=](Scanner& in)->ParseResult<R> {
-    auto v = many(p)(in).value();
-    if (v.empty()) return {};
-    return v;
+    R r;
+    ParseResult<T> v;
+    while ((v = detail::attempt(p, in))) {
+      r.emplace_back(v.value());
+    }
+    if (r.empty()) return {};
+    return r;
   };
 }
 
@@ -262,27 +399,158 @@ Parser<Nothing> not_predicate(const Parser<T>& p) {
 }
 
 
+enum class Assoc { left, right };
+
+// Operator table for precedence(). Higher `prec` binds tighter; prefix
+// operators bind tighter than every infix operator. Tokens made of letters
+// only match as whole words.
+template<typename Op>
+struct OperatorEntry {
+  std::string token;
+  Op op;
+  int prec = 0;
+  Assoc assoc = Assoc::left;
+};
+
+template<typename PrefixOp, typename InfixOp = PrefixOp>
+struct OperatorTable {
+  std::vector<OperatorEntry<PrefixOp>> prefix;
+  std::vector<OperatorEntry<InfixOp>> infix;
+  std::pair<std::string, std::string> group; // brackets around a subexpression, none if empty
+};
+
+namespace detail {
+  template<typename Entry>
+  const Entry* match_operator(const Scanner& in, const std::vector<Entry>& table, int min_prec = 0) {
+    const Entry* best = nullptr;
+    for (auto& e: table) {
+      if (e.prec < min_prec || !in.starts_with(e.token)) continue;
+      if (isalpha(e.token.back()) && in.size() > e.token.size() && isalnum(in[e.token.size()])) continue;
+      if (!best || e.token.size() > best->token.size()) best = &e;
+    }
+    return best;
+  }
+}
+
+// Operator-precedence parsing over `operand`, with grouping by
+// `table.group` if set. It runs on explicit heap stacks, one frame per open
+// group, so nesting depth is not limited by the call stack. If the right
+// operand of an infix operator fails, the operator is left unconsumed and
+// the expression ends before it; a group that fails is a failed operand.
+template<typename T, typename P, typename I, typename U, typename B>
+Parser<T> precedence(const Parser<T>& operand, const OperatorTable<P, I>& table, U&& make_unary, B&& make_binary) {
+  return [=](Scanner& in)->ParseResult<T> {
+    struct Frame {
+      std::vector<T> values;
+      std::vector<std::pair<const OperatorEntry<I>*, Scanner>> ops; // with the scanner before each
+      std::vector<P> prefix; // prefix operators of the operand being parsed
+    };
+    auto skip = [&]{ if (in.skip) skip_space(in); };
+    auto restore = [&](Scanner s) {
+      s.furthest = std::min(s.furthest, in.furthest);
+      in = s;
+    };
+    auto reduce = [&](Frame& f) {
+      T r = f.values.back();
+      f.values.pop_back();
+      f.values.back() = make_binary(f.values.back(), f.ops.back().first->op, r);
+      f.ops.pop_back();
+    };
+    auto push_operand = [&](Frame& f, T v) {
+      for (auto it = f.prefix.rbegin(); it != f.prefix.rend(); ++it) v = make_unary(*it, v);
+      f.prefix.clear();
+      f.values.push_back(v);
+    };
+
+    std::vector<Frame> frames(1);
+    enum { operand_, infix_, close_ } state = operand_;
+    while (true) {
+      auto& f = frames.back();
+      if (state == operand_) {
+        for (skip(); auto e = detail::match_operator(in, table.prefix); skip()) {
+          f.prefix.push_back(e->op);
+          in.remove_prefix(e->token.size());
+        }
+        if (!table.group.first.empty() && in.starts_with(table.group.first)) {
+          in.remove_prefix(table.group.first.size());
+          frames.emplace_back();
+          continue;
+        }
+        if (auto v = operand(in)) {
+          push_operand(f, v.value());
+          state = infix_;
+          continue;
+        }
+      } else if (state == infix_) {
+        auto before = in;
+        skip();
+        if (auto e = detail::match_operator(in, table.infix)) {
+          in.remove_prefix(e->token.size());
+          while (!f.ops.empty() && (f.ops.back().first->prec > e->prec ||
+                                    (f.ops.back().first->prec == e->prec && e->assoc == Assoc::left)))
+            reduce(f);
+          f.ops.emplace_back(e, before);
+          state = operand_;
+          continue;
+        }
+        in.furthest = std::min(in.furthest, in.size());
+        restore(before);
+        state = close_;
+        continue;
+      } else {
+        while (!f.ops.empty()) reduce(f);
+        if (frames.size() == 1) return f.values.back();
+        skip();
+        if (in.starts_with(table.group.second)) {
+          in.remove_prefix(table.group.second.size());
+          T v = f.values.back();
+          frames.pop_back();
+          push_operand(frames.back(), v);
+          state = infix_;
+          continue;
+        }
+        frames.pop_back();
+      }
+      // An operand failed. Groups that fail before their first operator
+      // fail as operands in turn; otherwise the innermost frame ends before
+      // its last operator.
+      while (frames.back().ops.empty()) {
+        frames.pop_back();
+        if (frames.empty()) return {}; // `in` stays where it failed
+      }
+      auto& g = frames.back();
+      g.prefix.clear();
+      restore(g.ops.back().second);
+      g.ops.pop_back();
+      state = close_;
+    }
+  };
+}
+
 // ========================= end =========================
 
 template<typename T>
 ParseResult<T> Parser<T>::operator () (Scanner& in) const {
-  bool flip = !skip_ && in.skip;
-  if (flip) in.skip = !in.skip;
-  if (in.skip) {
-    auto any_char = ch([](char){ return true; });
-    while (alt(
-      ch(isspace),
-      seq(
-        lit("/*"),
-        many(seq(not_predicate(lit("*/")), any_char)),
-        lit("*/")
-      ),
-      seq(
-        lit("//"), many(seq(not_predicate(lit("\n")), any_char))
-      )
-    ).atom()(in));
+  if (name_ && grammar_profiler) {
+    grammar_profiler->enter(name_, in.size());
+    ParseResult<T> r;
+    try {
+      r = parse(in);
+    } catch (...) {
+      grammar_profiler->exit(in.size(), false);
+      throw;
+    }
+    grammar_profiler->exit(in.size(), r.has_value());
+    return r;
   }
+  return parse(in);
+}
 
+template<typename T>
+ParseResult<T> Parser<T>::parse(Scanner& in) const {
+  bool flip = !skip_ && in.skip;
+  if (flip) in.skip = !in.skip;
+  if (in.skip) skip_space(in);
   auto r = p(in);
   if (flip) in.skip = !in.skip;
   return r;